@@ -0,0 +1,247 @@
+/*
+ * bsparea.cpp - area portals
+ *
+ * Copyright (C) 2014 Michael Rieder
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <float.h>
+#include <algorithm>
+#include "main.h"
+#include "bspmap.h"
+
+/*
+================
+bspmap::boxleafs
+
+append the leafs of the subtree num that the box touches
+================
+*/
+void bspmap::boxleafs( const float *mins, const float *maxs, int32_t num, std::vector<uint32_t> *out ) const
+{
+	while (num >= 0) {
+		const cnode_s *node = cnodes + num;
+		float nearest = -node->dist, farthest = -node->dist;
+		for (int c=0;c<3;c++) {
+			float lo = mins[c] * node->normal[c];
+			float hi = maxs[c] * node->normal[c];
+			nearest += std::min( lo, hi );
+			farthest += std::max( lo, hi );
+		}
+		if (nearest >= 0)
+			num = node->children[0];
+		else if (farthest < 0)
+			num = node->children[1];
+		else {
+			boxleafs( mins, maxs, node->children[0], out );
+			num = node->children[1];
+		}
+	}
+	out->push_back( -1 - num );
+}
+
+/*
+================
+bspmap::load_areaportals
+
+q3map splits the areas along the brushes with areaportal contents, so
+the leafs next to such a brush are in the two areas it separates. the
+portals start out closed, like the doors that are built around them
+================
+*/
+void bspmap::load_areaportals( void )
+{
+	areaportals.clear();
+	areaflood.assign( numareas, 0 );
+	areamarks.assign( numareas, 0 );
+	areamark = 0;
+	areastamp = 0;
+	for (uint_t a=0;a<numareas;a++)
+		areaflood[a] = ++floodnum;
+
+	std::vector<uint32_t> touched;
+	for (uint_t b=0;b<numbrushes;b++) {
+		const dbrush_s *brush = brushes + b;
+		if (brush->shaderNum >= numshaders || !(shaders[brush->shaderNum].contentFlags & CONTENTS_AREAPORTAL))
+			continue;
+
+		// the bounds come from the axial sides
+		areaportal_s portal;
+		int found = 0;
+		for (uint_t s=0;s<brush->numSides;s++) {
+			uint_t side = brush->firstSide + s;
+			if (side >= numbrushsides || brushsides[side].planeNum >= numplanes)
+				continue;
+			const dplane_s *plane = planes + brushsides[side].planeNum;
+			for (int c=0;c<3;c++) {
+				if (plane->normal[c] == 1.0f) {
+					portal.maxs[c] = plane->dist;
+					found |= 8<<c;
+				} else if (plane->normal[c] == -1.0f) {
+					portal.mins[c] = -plane->dist;
+					found |= 1<<c;
+				}
+			}
+		}
+		if (found != 0x3f || numcnodes == 0)
+			continue;
+
+		float mins[3], maxs[3];
+		for (int c=0;c<3;c++) {
+			mins[c] = portal.mins[c] - AREAPORTAL_EPSILON;
+			maxs[c] = portal.maxs[c] + AREAPORTAL_EPSILON;
+		}
+		touched.clear();
+		boxleafs( mins, maxs, 0, &touched );
+		int numfound = 0;
+		for (size_t k=0;k<touched.size() && numfound<2;k++) {
+			const dleaf_s *leaf = leafs + touched[k];
+			if ((int32_t)leaf->cluster < 0 || leaf->area >= numareas)
+				continue;
+			if (numfound == 0 || leaf->area != portal.area[0])
+				portal.area[numfound++] = leaf->area;
+		}
+		if (numfound < 2) {
+			con_printf( "areaportal brush %i touches only one area\n", b );
+			continue;
+		}
+		portal.open = false;
+		areaportals.push_back( portal );
+	}
+
+	// the portals of each area, to flood through
+	areaportalfirst.assign( numareas+1, 0 );
+	for (size_t p=0;p<areaportals.size();p++) {
+		areaportalfirst[areaportals[p].area[0]+1]++;
+		areaportalfirst[areaportals[p].area[1]+1]++;
+	}
+	for (uint_t a=0;a<numareas;a++)
+		areaportalfirst[a+1] += areaportalfirst[a];
+	areaportalrefs.resize( 2*areaportals.size() );
+	std::vector<uint32_t> fill( areaportalfirst.begin(), areaportalfirst.end()-1 );
+	for (size_t p=0;p<areaportals.size();p++) {
+		areaportalrefs[fill[areaportals[p].area[0]]++] = p;
+		areaportalrefs[fill[areaportals[p].area[1]]++] = p;
+	}
+	con_printf( "%i areaportals\n", (int)areaportals.size() );
+}
+
+/*
+================
+bspmap::floodareas
+
+mark the areas reachable from area through open portals with areamark,
+and set their areaflood to flood unless it is 0. returns true if stop
+was reached
+================
+*/
+bool bspmap::floodareas( uint32_t area, uint32_t flood, int stop )
+{
+	bool reached = false;
+	areamark++;
+	areamarks[area] = areamark;
+	areastack.assign( 1, area );
+	while (!areastack.empty()) {
+		uint32_t a = areastack.back();
+		areastack.pop_back();
+		if (flood)
+			areaflood[a] = flood;
+		if ((int)a == stop)
+			reached = true;
+		for (uint32_t k=areaportalfirst[a];k<areaportalfirst[a+1];k++) {
+			const areaportal_s *portal = &areaportals[areaportalrefs[k]];
+			if (!portal->open)
+				continue;
+			uint32_t other = portal->area[0] == a ? portal->area[1] : portal->area[0];
+			if (areamarks[other] != areamark) {
+				areamarks[other] = areamark;
+				areastack.push_back( other );
+			}
+		}
+	}
+	return reached;
+}
+
+/*
+================
+bspmap::setareaportal
+
+open or close a portal. only the areas on its two sides are flooded
+again, and only if they get connected or separated by it. the cached
+surface lists of everything else stay valid
+================
+*/
+void bspmap::setareaportal( uint_t num, bool open )
+{
+	if (num >= areaportals.size() || areaportals[num].open == open)
+		return;
+	areaportal_s *portal = &areaportals[num];
+	portal->open = open;
+	uint32_t a = portal->area[0], b = portal->area[1];
+
+	if (open) {
+		if (areaflood[a] == areaflood[b])
+			return;
+		floodareas( a, ++floodnum, -1 );
+	} else {
+		if (floodareas( a, 0, b ))
+			return;
+		floodareas( a, ++floodnum, -1 );
+		floodareas( b, ++floodnum, -1 );
+	}
+	areastamp++;
+}
+
+/*
+================
+bspmap::nearestareaportal
+
+the portal with its center closest to pos, -1 if there are none
+================
+*/
+int bspmap::nearestareaportal( const float *pos ) const
+{
+	int best = -1;
+	float bestdist = FLT_MAX;
+	for (size_t p=0;p<areaportals.size();p++) {
+		float dist = 0;
+		for (int c=0;c<3;c++) {
+			float d = pos[c] - 0.5f*(areaportals[p].mins[c] + areaportals[p].maxs[c]);
+			dist += d*d;
+		}
+		if (dist < bestdist) {
+			bestdist = dist;
+			best = p;
+		}
+	}
+	return best;
+}
+
+/*
+================
+bspmap::areasconnected
+================
+*/
+bool bspmap::areasconnected( int area1, int area2 ) const
+{
+	if (area1 < 0 || area2 < 0 || (uint_t)area1 >= numareas || (uint_t)area2 >= numareas)
+		return true;
+	return areaflood[area1] == areaflood[area2];
+}
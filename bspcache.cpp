@@ -0,0 +1,328 @@
+/*
+ * bspcache.cpp - baked map cache
+ *
+ * Copyright (C) 2014 Michael Rieder
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <sys/stat.h>
+#include "main.h"
+#include "bspmap.h"
+#include "bspcache.h"
+#include "tdogl/Bitmap.h"
+
+#define CACHE_NAME_LEN	64	// as dshader_s::shader
+
+// size of one element of each lump
+static const size_t cacheelemsize[cache_max] = {
+	sizeof(drawVert_s),
+	2*sizeof(uint16_t),
+	sizeof(uint32_t),
+	sizeof(uint32_t),
+	sizeof(uint32_t),
+	sizeof(surfbatch_s),
+	sizeof(patchsurf_s),
+	sizeof(patchlod_s),
+	CACHE_NAME_LEN,
+	sizeof(textureimage_s),
+	1,
+	LIGHTMAP_BLOCK_LEN
+};
+
+static uint64_t cache_align( uint64_t offset )
+{
+	return (offset + CACHE_ALIGN-1) & ~(uint64_t)(CACHE_ALIGN-1);
+}
+
+// decode all textures like the renderer would, RGBA and bottom up
+static void cache_decodetextures( const renderdata_s *renderData, std::vector<tdogl::Bitmap*> *bitmaps )
+{
+	uint_t texcount = renderData->texcount;
+	bitmaps->assign( texcount, NULL );
+
+	std::atomic<uint_t> next(0);
+	auto worker = [&]() {
+		uint_t k;
+		while ((k = next++) < texcount)
+			(*bitmaps)[k] = tdogl::Bitmap::textureFromFile(renderData->texarray[k]);
+	};
+
+	tdogl::Bitmap::prepareDecoders();
+	uint_t numworkers = std::min( std::max( std::thread::hardware_concurrency(), 1u ), std::max( texcount, 1u ) );
+	std::vector<std::thread> pool;
+	for (uint_t k=1;k<numworkers;k++)
+		pool.push_back( std::thread( worker ) );
+	worker();
+	for (size_t k=0;k<pool.size();k++)
+		pool[k].join();
+}
+
+// every index and range has to stay inside the table it points into
+static bool cache_checkranges( const void *const *data, const uint64_t *counts )
+{
+	const uint32_t *indexes = static_cast<const uint32_t*>( data[cache_indexes] );
+	for (uint64_t k=0;k<counts[cache_indexes];k++)
+		if (indexes[k] >= counts[cache_vertexes])
+			return false;
+
+	uint64_t surfcount = counts[cache_surfrank];
+	const uint32_t *surfrank = static_cast<const uint32_t*>( data[cache_surfrank] );
+	const uint32_t *rankfirstindex = static_cast<const uint32_t*>( data[cache_rankfirstindex] );
+	for (uint64_t k=0;k<surfcount;k++)
+		if (surfrank[k] >= surfcount || rankfirstindex[k] > rankfirstindex[k+1])
+			return false;
+	if (rankfirstindex[surfcount] > counts[cache_indexes])
+		return false;
+
+	const surfbatch_s *batches = static_cast<const surfbatch_s*>( data[cache_batches] );
+	for (uint64_t k=0;k<counts[cache_batches];k++)
+		if ((uint64_t)batches[k].firstRank + batches[k].numRanks > surfcount)
+			return false;
+
+	const patchsurf_s *patches = static_cast<const patchsurf_s*>( data[cache_patches] );
+	for (uint64_t k=0;k<counts[cache_patches];k++)
+		if (patches[k].rank >= surfcount || patches[k].numLods == 0
+				|| (uint64_t)patches[k].firstLod + patches[k].numLods > counts[cache_patchlods])
+			return false;
+
+	const patchlod_s *lods = static_cast<const patchlod_s*>( data[cache_patchlods] );
+	for (uint64_t k=0;k<counts[cache_patchlods];k++)
+		if ((uint64_t)lods[k].firstIndex + lods[k].numIndexes > counts[cache_indexes])
+			return false;
+	return true;
+}
+
+// zero fill up to the lump's offset, then write it
+static bool cache_writelump( FILE *f, const cachelump_s *lump, const void *data )
+{
+	static const uint8_t zeros[CACHE_ALIGN] = { 0 };
+	long pos = ftell( f );
+	if (pos < 0 || (uint64_t)pos > lump->offset || lump->offset - pos > CACHE_ALIGN)
+		return false;
+	if (fwrite( zeros, 1, lump->offset - pos, f ) != lump->offset - pos)
+		return false;
+	return data == NULL || fwrite( data, 1, lump->length, f ) == lump->length;
+}
+
+/*
+================
+cache_write
+
+bake the render data of a map, with its textures decoded, into one
+file that cache_load can use in place. written under a temporary
+name first, so a failed write never leaves a broken cache behind
+================
+*/
+bool cache_write( const char *filename, uint32_t checksum, const renderdata_s *renderData )
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint_t texcount = renderData->texcount;
+
+	std::vector<tdogl::Bitmap*> bitmaps;
+	cache_decodetextures( renderData, &bitmaps );
+	std::vector<textureimage_s> images( texcount );
+	std::vector<char> names( texcount*CACHE_NAME_LEN, 0 );
+	uint64_t texbytes = 0;
+	for (uint_t k=0;k<texcount;k++) {
+		strncpy( names.data() + k*CACHE_NAME_LEN, renderData->texarray[k], CACHE_NAME_LEN-1 );
+		images[k].width = bitmaps[k] ? bitmaps[k]->width() : 0;
+		images[k].height = bitmaps[k] ? bitmaps[k]->height() : 0;
+		images[k].offset = texbytes;
+		texbytes += (uint64_t)images[k].width * images[k].height * 4;
+	}
+
+	const void *data[cache_max] = {
+		NULL,		// written in two parts if the patch vertices are apart
+		renderData->layerData,
+		renderData->idxData,
+		renderData->surfRank,
+		renderData->rankFirstIndex,
+		renderData->batches,
+		renderData->patches,
+		renderData->patchLods,
+		names.data(),
+		images.data(),
+		NULL,		// written texture by texture
+		renderData->lightmapData
+	};
+	uint64_t counts[cache_max] = {
+		renderData->vtxcount,
+		renderData->vtxcount,
+		renderData->idxcount,
+		renderData->surfcount,
+		renderData->surfcount + 1,
+		renderData->batchcount,
+		renderData->patchcount,
+		renderData->patchlodcount,
+		texcount,
+		texcount,
+		texbytes,
+		renderData->lightmapcount
+	};
+
+	cacheheader_s header;
+	memset( &header, 0, sizeof(header) );
+	memcpy( header.id, CACHE_ID, sizeof(header.id) );
+	header.version = CACHE_VERSION;
+	header.checksum = checksum;
+	uint64_t offset = cache_align( sizeof(header) );
+	for (int k=0;k<cache_max;k++) {
+		header.lumps[k].offset = offset;
+		header.lumps[k].length = counts[k] * cacheelemsize[k];
+		offset = cache_align( offset + header.lumps[k].length );
+	}
+
+	std::string tempname = std::string( filename ) + ".tmp";
+	FILE *f = fopen( tempname.c_str(), "wb" );
+	bool ok = f != NULL;
+	if (ok)
+		ok = fwrite( &header, sizeof(header), 1, f ) == 1;
+	for (int k=0;k<cache_max && ok;k++) {
+		ok = cache_writelump( f, &header.lumps[k], data[k] );
+		if (k == cache_vertexes && ok) {
+			uint_t patchcount = renderData->patchVtxData ? renderData->patchvtxcount : 0;
+			uint_t mapcount = renderData->vtxcount - patchcount;
+			ok = fwrite( renderData->vtxData, sizeof(drawVert_s), mapcount, f ) == mapcount
+				&& fwrite( renderData->patchVtxData, sizeof(drawVert_s), patchcount, f ) == patchcount;
+		}
+		if (k != cache_texdata)
+			continue;
+		for (uint_t t=0;t<texcount && ok;t++) {
+			if (bitmaps[t] == NULL)
+				continue;
+			size_t pixels = bitmaps[t]->width() * bitmaps[t]->height();
+			ok = fwrite( bitmaps[t]->pixelBuffer(), 4, pixels, f ) == pixels;
+		}
+	}
+	// pad the end too, so even empty lumps lie inside the file
+	cachelump_s end = { offset, 0 };
+	if (ok)
+		ok = cache_writelump( f, &end, NULL );
+	if (f)
+		ok = fclose( f ) == 0 && ok;
+	if (ok)
+		ok = rename( tempname.c_str(), filename ) == 0;
+	for (uint_t k=0;k<texcount;k++)
+		delete bitmaps[k];
+
+	if (!ok) {
+		remove( tempname.c_str() );
+		con_printf( "could not write map cache %s\n", filename );
+		return false;
+	}
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	con_printf( "baked map cache %s, %.1f MB in %.2f ms\n", filename, offset / (1024.0*1024.0), elapsed.count() );
+	return true;
+}
+
+/*
+================
+cache_load
+
+map a cache written by cache_write and point renderData into it. the
+returned stream has to stay open while renderData is in use. returns
+NULL if there is no cache, or it was baked from another map or by
+another version, so the caller bakes a new one
+================
+*/
+filestream *cache_load( const char *filename, uint32_t checksum, renderdata_s *renderData )
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	struct stat st;
+	if (stat( filename, &st ) != 0)
+		return NULL;
+
+	filestream *f = new filestream( filename, FS_MMAP );
+	const cacheheader_s *header = static_cast<const cacheheader_s*>( f->view( 0, sizeof(cacheheader_s) ) );
+	if (header == NULL || memcmp( header->id, CACHE_ID, sizeof(header->id) )
+			|| header->version != CACHE_VERSION || header->checksum != checksum) {
+		con_printf( "map cache %s is stale\n", filename );
+		delete f;
+		return NULL;
+	}
+
+	const void *data[cache_max];
+	uint64_t counts[cache_max];
+	for (int k=0;k<cache_max;k++) {
+		const cachelump_s *lump = header->lumps + k;
+		data[k] = NULL;
+		if (lump->offset % CACHE_ALIGN == 0 && lump->length % cacheelemsize[k] == 0
+				&& lump->offset <= f->length() && lump->length <= f->length() - lump->offset)
+			data[k] = f->view( lump->offset, lump->length );
+		if (data[k] == NULL) {
+			con_printf( "map cache %s: bad lump %i\n", filename, k );
+			delete f;
+			return NULL;
+		}
+		counts[k] = lump->length / cacheelemsize[k];
+	}
+
+	// the counts the lumps have to agree on
+	bool ok = counts[cache_layers] == counts[cache_vertexes]
+		&& counts[cache_rankfirstindex] == counts[cache_surfrank] + 1
+		&& counts[cache_textures] == counts[cache_shadernames];
+	const char *names = static_cast<const char*>( data[cache_shadernames] );
+	const textureimage_s *images = static_cast<const textureimage_s*>( data[cache_textures] );
+	for (uint64_t k=0;k<counts[cache_textures] && ok;k++) {
+		uint64_t size = (uint64_t)images[k].width * images[k].height * 4;
+		ok = names[k*CACHE_NAME_LEN + CACHE_NAME_LEN-1] == 0
+			&& images[k].offset <= counts[cache_texdata]
+			&& size <= counts[cache_texdata] - images[k].offset;
+	}
+	if (ok)
+		ok = cache_checkranges( data, counts );
+	if (!ok) {
+		con_printf( "map cache %s is inconsistent\n", filename );
+		delete f;
+		return NULL;
+	}
+
+	renderData->vtxData = data[cache_vertexes];
+	renderData->vtxcount = counts[cache_vertexes];
+	renderData->patchVtxData = NULL;
+	renderData->patchvtxcount = 0;
+	renderData->layerData = static_cast<const uint16_t*>( data[cache_layers] );
+	renderData->idxData = static_cast<const uint32_t*>( data[cache_indexes] );
+	renderData->idxcount = counts[cache_indexes];
+	renderData->surfRank = static_cast<const uint32_t*>( data[cache_surfrank] );
+	renderData->rankFirstIndex = static_cast<const uint32_t*>( data[cache_rankfirstindex] );
+	renderData->surfcount = counts[cache_surfrank];
+	renderData->batches = static_cast<const surfbatch_s*>( data[cache_batches] );
+	renderData->batchcount = counts[cache_batches];
+	renderData->patches = static_cast<const patchsurf_s*>( data[cache_patches] );
+	renderData->patchcount = counts[cache_patches];
+	renderData->patchLods = static_cast<const patchlod_s*>( data[cache_patchlods] );
+	renderData->patchlodcount = counts[cache_patchlods];
+	renderData->texarray = new const char *[counts[cache_shadernames]];
+	for (uint64_t k=0;k<counts[cache_shadernames];k++)
+		renderData->texarray[k] = names + k*CACHE_NAME_LEN;
+	renderData->texcount = counts[cache_shadernames];
+	renderData->teximages = images;
+	renderData->texData = static_cast<const uint8_t*>( data[cache_texdata] );
+	renderData->lightmapData = static_cast<const uint8_t*>( data[cache_lightmaps] );
+	renderData->lightmapcount = counts[cache_lightmaps];
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	con_printf( "loaded map cache %s in %.2f ms\n", filename, elapsed.count() );
+	return f;
+}
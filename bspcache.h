@@ -0,0 +1,70 @@
+/*
+ * bspcache.h - baked map cache
+ *
+ * Copyright (C) 2014 Michael Rieder
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#ifndef BSPCACHE_H
+#define BSPCACHE_H
+
+#include <cstdint>
+
+#define CACHE_ID	"LBC "
+#define CACHE_VERSION	1	// bump whenever the baked data or its layout changes
+#define CACHE_ALIGN	16	// of every lump, so they can be used in place
+#define CACHE_EXT	".lbc"
+
+typedef enum {
+	cache_vertexes,		// drawVert_s pool
+	cache_layers,		// uint16_t pairs
+	cache_indexes,
+	cache_surfrank,
+	cache_rankfirstindex,
+	cache_batches,
+	cache_patches,
+	cache_patchlods,
+	cache_shadernames,	// 64 chars each, as in dshader_s
+	cache_textures,		// textureimage_s per shader
+	cache_texdata,
+	cache_lightmaps,
+	cache_max
+} cachelumps_e;
+
+typedef struct {
+	uint64_t	offset;
+	uint64_t	length;
+} cachelump_s;
+
+typedef struct {
+	char		id[4];
+	uint32_t	version;
+	uint32_t	checksum;	// of the bsp it was baked from
+	uint32_t	pad;
+	cachelump_s	lumps[cache_max];
+} cacheheader_s;
+
+class filestream;
+
+// bspcache.cpp
+bool cache_write( const char *filename, uint32_t checksum, const renderdata_s *renderData );
+filestream *cache_load( const char *filename, uint32_t checksum, renderdata_s *renderData );
+
+#endif // BSPCACHE_H
@@ -22,10 +22,15 @@
  * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
 #include "main.h"
 #include "bspmap.h"
 
-void count_clusters_areas( dleaf_s *leafs, uint_t numleafs, uint_t *numclusters, uint_t *numareas );
+void count_clusters_areas( const dleaf_s *leafs, uint_t numleafs, uint_t *numclusters, uint_t *numareas );
 
 void bspmap::load_lump( lumpdata_s *lump )
 {
@@ -45,19 +50,72 @@ void bspmap::load_lump( lumpdata_s *lump )
 	}
 
 	*lump->numblocks = length / lump->blocksize;
-	*lump->ptr = operator new(length);
-	mapfile->seek( offset );
-	mapfile->read( *lump->ptr, length );
+
+	// point straight into the mapped file if the lump is suitably aligned
+	const void *view = mapfile->view( offset, length );
+	if (view && reinterpret_cast<uintptr_t>(view) % sizeof(uint32_t) == 0) {
+		*lump->ptr = view;
+		return;
+	}
+
+	void *buffer = operator new(length);
+	size_t count = mapfile->readat( buffer, length, offset );
+	if (count < length) {
+		con_printf( "lump %i is truncated, %i of %i bytes\n", lump->lumptype, (int)count, length );
+		operator delete(buffer);
+		*lump->numblocks = 0;
+		*lump->ptr = NULL;
+		return;
+	}
+	lumpbuffers[lump->lumptype] = buffer;
+	*lump->ptr = buffer;
+}
+
+/*
+================
+bspmap::load_lumps_parallel
+
+hand the lumps out to a pool of workers, biggest first so
+the large lumps (drawverts, lightmaps, ...) start right away
+================
+*/
+void bspmap::load_lumps_parallel( lumpdata_s *lumplist, int numlumps )
+{
+	std::vector<lumpdata_s*> order;
+	for (int k=0;k<numlumps;k++)
+		order.push_back( lumplist + k );
+	std::sort( order.begin(), order.end(),
+		[this]( const lumpdata_s *a, const lumpdata_s *b ) {
+			return lumps[a->lumptype].length > lumps[b->lumptype].length;
+		} );
+
+	std::atomic<int> next(0);
+	auto worker = [&]() {
+		int k;
+		while ((k = next++) < numlumps)
+			load_lump( order[k] );
+	};
+
+	uint_t numworkers = std::min( std::max( std::thread::hardware_concurrency(), 1u ), (uint_t)numlumps );
+	std::vector<std::thread> pool;
+	for (uint_t k=1;k<numworkers;k++)
+		pool.push_back( std::thread( worker ) );
+	worker();
+	for (size_t k=0;k<pool.size();k++)
+		pool[k].join();
 }
 
-void count_clusters_areas( dleaf_s *leafs, uint_t numleafs, uint_t *numclusters, uint_t *numareas )
+void count_clusters_areas( const dleaf_s *leafs, uint_t numleafs, uint_t *numclusters, uint_t *numareas )
 {
 	// count the clusters and areas
 	*numclusters = 0;
 	*numareas = 0;
 	
 	for (uint_t i=0;i<numleafs;i++) {
-		dleaf_s *leaf = leafs+i;
+		const dleaf_s *leaf = leafs+i;
+		// solid leafs have cluster -1
+		if ((int32_t)leaf->cluster < 0)
+			continue;
 		if (leaf->cluster >= *numclusters)
 			*numclusters = leaf->cluster + 1;
 		if (leaf->area >= *numareas)
@@ -68,22 +126,36 @@ void count_clusters_areas( dleaf_s *leafs, uint_t numleafs, uint_t *numclusters,
 void bspmap::load_all_lumps( void )
 {
 	lumpdata_s lumplist[] = {
-	/*00*/	{lump_shaders,sizeof(dshader_s), &numshaders,reinterpret_cast<void**>(&shaders)},
-	/*01*/	{lump_planes,sizeof(dplane_s), &numplanes,reinterpret_cast<void**>(&planes)},
-	/*02*/	{lump_lightmaps,LIGHTMAP_BLOCK_LEN, &numlightmaps,reinterpret_cast<void**>(&lightmapdata)},
-	/*03*/	{lump_surfaces,sizeof(dsurface_s), &numsurfaces,reinterpret_cast<void**>(&surfaces)},
-	/*04*/	{lump_drawverts,sizeof(drawVert_s), &numdrawverts,reinterpret_cast<void**>(&drawverts)},
-	/*05*/	{lump_drawindexes,sizeof(uint32_t), &numdrawindexes,reinterpret_cast<void**>(&drawindexes)},
-	/*07*/	{lump_leafsurfaces,sizeof(uint32_t), &numleafsurfaces,reinterpret_cast<void**>(&leafsurfaces)},
-	/*08*/	{lump_leafs,sizeof(dleaf_s), &numleafs,reinterpret_cast<void**>(&leafs)},
-	/*09*/	{lump_nodes,sizeof(dnode_s), &numnodes,reinterpret_cast<void**>(&nodes)},
-	/*14*/	{lump_entities,sizeof(char), &entitystringlen,reinterpret_cast<void**>(&entitystring)}
+	/*00*/	{lump_shaders,sizeof(dshader_s), &numshaders,reinterpret_cast<const void**>(&shaders)},
+	/*01*/	{lump_planes,sizeof(dplane_s), &numplanes,reinterpret_cast<const void**>(&planes)},
+	/*02*/	{lump_lightmaps,LIGHTMAP_BLOCK_LEN, &numlightmaps,reinterpret_cast<const void**>(&lightmapdata)},
+	/*03*/	{lump_surfaces,sizeof(dsurface_s), &numsurfaces,reinterpret_cast<const void**>(&surfaces)},
+	/*04*/	{lump_drawverts,sizeof(drawVert_s), &numdrawverts,reinterpret_cast<const void**>(&drawverts)},
+	/*05*/	{lump_drawindexes,sizeof(uint32_t), &numdrawindexes,reinterpret_cast<const void**>(&drawindexes)},
+	/*06*/	{lump_leafbrushes,sizeof(uint32_t), &numleafbrushes,reinterpret_cast<const void**>(&leafbrushes)},
+	/*07*/	{lump_leafsurfaces,sizeof(uint32_t), &numleafsurfaces,reinterpret_cast<const void**>(&leafsurfaces)},
+	/*08*/	{lump_leafs,sizeof(dleaf_s), &numleafs,reinterpret_cast<const void**>(&leafs)},
+	/*09*/	{lump_nodes,sizeof(dnode_s), &numnodes,reinterpret_cast<const void**>(&nodes)},
+	/*11*/	{lump_brushsides,sizeof(dbrushside_s), &numbrushsides,reinterpret_cast<const void**>(&brushsides)},
+	/*12*/	{lump_brushes,sizeof(dbrush_s), &numbrushes,reinterpret_cast<const void**>(&brushes)},
+	/*14*/	{lump_entities,sizeof(char), &entitystringlen,reinterpret_cast<const void**>(&entitystring)},
+	/*15*/	{lump_visibility,sizeof(uint8_t), &numvisbytes,reinterpret_cast<const void**>(&visdata)}
 	};
 	int numlumplist = sizeof(lumplist)/sizeof(lumpdata_s);
-	
-	for (int k=0;k<numlumplist;k++) {
-		load_lump( lumplist + k );
+
+	// mapped lumps are mostly views and compressed streams can't be read
+	// concurrently, only worth spreading out buffered reads
+	bool parallel = parallelload && !mapfile->mapped() && !mapfile->compressed();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (parallel)
+		load_lumps_parallel( lumplist, numlumplist );
+	else {
+		for (int k=0;k<numlumplist;k++)
+			load_lump( lumplist + k );
 	}
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	con_printf( "loaded %i lumps in %.2f ms (%s)\n", numlumplist, elapsed.count(),
+			parallel ? "parallel" : "serial" );
 
 	con_printf( "%i shaders\n", numshaders );
 	//for (uint_t k=0;k<numshaders;k++)
@@ -93,7 +165,7 @@ void bspmap::load_all_lumps( void )
 	con_printf( "%i lightmaps\n", numlightmaps );
 
 	for (uint_t k=0;k<numsurfaces;k++) {
-		dsurface_s *surf = surfaces + k;
+		const dsurface_s *surf = surfaces + k;
 		switch (surf->surfaceType){
 			case MST_BAD:
 				con_printf( "bad surface type\n");
@@ -126,17 +198,22 @@ void bspmap::load_all_lumps( void )
 	con_printf( "%i leafs, %i clusters, %i areas\n",
 		numleafs, numclusters, numareas );
 	con_printf( "%i nodes\n", numnodes );
+	load_visibility();
+	load_tree();
+	load_brushes();
+	load_areaportals();
 	
 	//con_printf( "entities %s\n", entitystring );
 }
 
-void bspmap::open( const char* mname )
+void bspmap::open( const char* mname, fsmode_e mode )
 {
-	mapfile = new filestream( mname );
+	mapfile = new filestream( mname, mode );
 	mapfile->read( &header, sizeof(header) );
 
 	con_printf( "============================================================\n" );
-	con_printf( "opened map file \"%s\"\n", mname );
+	con_printf( "opened map file \"%s\" (%s)\n", mname,
+			mapfile->mapped() ? "mapped" : "buffered" );
 	con_printf( "format \"%c%c%c%c\"\n",
 			header.id[0],header.id[1],header.id[2],header.id[3] );
 	con_printf( "version BSP v%.2i\n", header.version );
@@ -154,55 +231,143 @@ void bspmap::open( const char* mname )
 
 void bspmap::close( void )
 {
-	void* allocated[] = {
-		leafs,
-		nodes,
-		leafsurfaces,
-		surfaces,
-		drawverts,
-		drawindexes,
-		shaders,
-		lightmapdata,
-		planes,
-		entitystring
-	};
-	int allocatednum = sizeof(allocated)/sizeof(void*);
-
-	for (int k=0;k<allocatednum;k++)
-		operator delete(allocated[k]);
+	for (int k=0;k<lump_max;k++) {
+		operator delete(lumpbuffers[k]);
+		lumpbuffers[k] = NULL;
+	}
 
 	delete mapfile;
+	mapfile = NULL;
 }
 
 void bspmap::getVertexData( renderdata_s *renderData )
 {
-	// count total number of verts in all surfaces
-	const uint_t flpervert = 3 + 3 + 3; // pos, texcoord, normal
-	uint_t num_verts=0;
-	for (uint_t k=0;k<numsurfaces;k++)
-		num_verts += surfaces[k].numIndexes;
+	// only needed here, a start from the map cache skips the tessellation
+	if (patchgrids.empty())
+		load_patches();
 
-	// allocate the needed space
-	float *vertexdata = new float[flpervert*num_verts];
+	// patches are drawn from their tessellation instead of the control points
+	std::vector<int32_t> patchof( numsurfaces, -1 );
+	for (size_t p=0;p<patchgrids.size();p++)
+		patchof[patchgrids[p].surface] = p;
+	uint_t poolsize = numdrawverts + vertexpool.size();
 
-	// copy the data
-	uint_t vert_counter=0;
+	// the vertex pool is used as is, surfaces just add the texture and lightmap layers
+	uint16_t *layers = new uint16_t[2*poolsize];
+	for (uint_t k=0;k<poolsize;k++) {
+		layers[2*k] = 0;
+		layers[2*k+1] = NO_LIGHTMAP;
+	}
+	uint_t num_indexes=0;
 	for (uint_t k=0;k<numsurfaces;k++) {
-		dsurface_s *surf = surfaces + k;
-		for (uint_t l=0;l<surf->numIndexes;l++) {
-			uint_t offset = surf->firstVert+drawindexes[surf->firstIndex+l];
-			memcpy( vertexdata+vert_counter*flpervert, drawverts[offset].xyz, 3*sizeof(float) ); // xyz
-			memcpy( vertexdata+3+vert_counter*flpervert, drawverts[offset].st, 2*sizeof(float) ); // st
-			vertexdata[3+vert_counter*flpervert+2] = surf->shaderNum; // 3rd texture coord
-			memcpy( vertexdata+6+vert_counter*flpervert, drawverts[offset].normal, 3*sizeof(float) ); // normal
-			vert_counter++;
+		const dsurface_s *surf = surfaces + k;
+		uint16_t lightmap = surf->lightmapNum < numlightmaps ? surf->lightmapNum : NO_LIGHTMAP;
+		for (uint_t l=0;l<surf->numVerts;l++) {
+			layers[2*(surf->firstVert+l)] = surf->shaderNum;
+			layers[2*(surf->firstVert+l)+1] = lightmap;
+		}
+		if (patchof[k] < 0) {
+			num_indexes += surf->numIndexes;
+			continue;
+		}
+		const patchgrid_s *grid = &patchgrids[patchof[k]];
+		for (uint_t l=0;l<grid->width*grid->height;l++) {
+			layers[2*(grid->firstVert+l)] = surf->shaderNum;
+			layers[2*(grid->firstVert+l)+1] = lightmap;
+		}
+		for (uint_t lod=0;lod<grid->numLods;lod++)
+			num_indexes += patchindexes( grid, lod, NULL );
+	}
+
+	// surfaces go into the index buffer sorted by surface type and shader,
+	// so the visible surfaces of a batch merge into few index ranges
+	std::vector<uint32_t> order( numsurfaces );
+	for (uint_t k=0;k<numsurfaces;k++)
+		order[k] = k;
+	std::stable_sort( order.begin(), order.end(), [this]( uint32_t a, uint32_t b ) {
+		if (surfaces[a].surfaceType != surfaces[b].surfaceType)
+			return surfaces[a].surfaceType < surfaces[b].surfaceType;
+		return surfaces[a].shaderNum < surfaces[b].shaderNum;
+	} );
+
+	// one global index buffer, surface indexes are relative to firstVert
+	uint32_t *indexes = new uint32_t[num_indexes];
+	uint32_t *rank = new uint32_t[numsurfaces];
+	uint32_t *firstindex = new uint32_t[numsurfaces+1];
+	std::vector<surfbatch_s> batches;
+	uint_t idx_counter=0;
+	for (uint_t r=0;r<numsurfaces;r++) {
+		const dsurface_s *surf = surfaces + order[r];
+		rank[order[r]] = r;
+		firstindex[r] = idx_counter;
+		if (patchof[order[r]] >= 0)
+			idx_counter += patchindexes( &patchgrids[patchof[order[r]]], 0, indexes+idx_counter );
+		else {
+			for (uint_t l=0;l<surf->numIndexes;l++)
+				indexes[idx_counter++] = surf->firstVert+drawindexes[surf->firstIndex+l];
+		}
+
+		if (batches.empty() || batches.back().surfaceType != surf->surfaceType) {
+			surfbatch_s batch = { surf->surfaceType, r, 0 };
+			batches.push_back( batch );
 		}
+		batches.back().numRanks++;
 	}
-	renderData->vtxData = vertexdata;
-	renderData->vtxcount = num_verts;
+	firstindex[numsurfaces] = idx_counter;
+
+	// the coarser patch lods follow all the surfaces
+	patchsurf_s *patches = new patchsurf_s[patchgrids.size()];
+	std::vector<patchlod_s> lods;
+	for (size_t p=0;p<patchgrids.size();p++) {
+		const patchgrid_s *grid = &patchgrids[p];
+		patchsurf_s *patch = patches + p;
+		patch->rank = rank[grid->surface];
+		patch->firstLod = lods.size();
+		patch->numLods = grid->numLods;
+		memcpy( patch->mins, grid->mins, sizeof(patch->mins) );
+		memcpy( patch->maxs, grid->maxs, sizeof(patch->maxs) );
+		for (uint_t lod=0;lod<grid->numLods;lod++) {
+			patchlod_s l;
+			if (lod == 0) {
+				l.firstIndex = firstindex[patch->rank];
+				l.numIndexes = firstindex[patch->rank+1] - l.firstIndex;
+			} else {
+				l.firstIndex = idx_counter;
+				l.numIndexes = patchindexes( grid, lod, indexes+idx_counter );
+				idx_counter += l.numIndexes;
+			}
+			l.error = grid->errors[lod];
+			lods.push_back( l );
+		}
+	}
+
+	renderData->vtxData = drawverts;
+	renderData->vtxcount = poolsize;
+	renderData->patchVtxData = vertexpool.empty() ? NULL : vertexpool.data();
+	renderData->patchvtxcount = vertexpool.size();
+	renderData->layerData = layers;
+	renderData->idxData = indexes;
+	renderData->idxcount = num_indexes;
+	renderData->surfRank = rank;
+	renderData->rankFirstIndex = firstindex;
+	renderData->surfcount = numsurfaces;
+	surfbatch_s *batcharray = new surfbatch_s[batches.size()];
+	std::copy( batches.begin(), batches.end(), batcharray );
+	renderData->batches = batcharray;
+	renderData->batchcount = batches.size();
+	renderData->patches = patches;
+	renderData->patchcount = patchgrids.size();
+	patchlod_s *lodarray = new patchlod_s[lods.size()];
+	std::copy( lods.begin(), lods.end(), lodarray );
+	renderData->patchLods = lodarray;
+	renderData->patchlodcount = lods.size();
 
 	renderData->texarray = new const char *[numshaders];
 	for (uint_t k=0;k<numshaders;k++)
 		renderData->texarray[k] = shaders[k].shader;
 	renderData->texcount = numshaders;
+	renderData->teximages = NULL;
+	renderData->texData = NULL;
+	renderData->lightmapData = lightmapdata;
+	renderData->lightmapcount = numlightmaps;
 }
@@ -26,7 +26,27 @@
 #define BSPMAP_H
 
 #define	LIGHTMAP_SIZE		128
+#define FRUSTUM_PLANES		6
+#define PATCH_MAX_SEGMENTS	16	// per curve piece and direction at the finest lod
+#define PATCH_MAX_LODS		5	// 16, 8, 4, 2 and 1 segments
+#define PATCH_SUBDIVISIONS	4.0f	// error allowed if the surface doesn't say
 #define LIGHTMAP_BLOCK_LEN	(LIGHTMAP_SIZE*LIGHTMAP_SIZE*3)
+#define SURFACE_CLIP_EPSILON	0.125f	// traces stop this far in front of a brush
+
+// content flags of the brush shaders
+#define CONTENTS_SOLID		0x1
+#define CONTENTS_AREAPORTAL	0x8000
+#define CONTENTS_PLAYERCLIP	0x10000
+#define MASK_PLAYERSOLID	(CONTENTS_SOLID|CONTENTS_PLAYERCLIP)
+
+#define VIS_CACHE_CLUSTERS	64	// pvs surface lists kept around
+#define AREAPORTAL_EPSILON	1.0f	// how far around an areaportal brush to look for its areas
+#define PLANE_NONAXIAL	3	// cnode_s::type of planes not facing along an axis
+#define CACHE_LINE	64
+
+#define RAY_PACKET	4	// rays walking the tree together
+#define RAY_BATCH	256	// rays a worker takes at a time
+#define TRACE_CHECKED	32	// brushes a trace remembers as tested
 
 typedef struct {
 	char		id[4];
@@ -144,6 +164,18 @@ typedef struct {
 	float		subdivisions;
 } dsurface_s;
 
+typedef struct {
+	uint32_t	firstSide;
+	uint32_t	numSides;
+	uint32_t	shaderNum;	// the contents come from the shader
+} dbrush_s;
+
+typedef struct {
+	uint32_t	planeNum;	// facing out of the brush
+	uint32_t	shaderNum;
+	uint32_t	equationNum;
+} dbrushside_s;
+
 typedef struct {
 	float		xyz[3];
 	float		st[2];
@@ -152,48 +184,189 @@ typedef struct {
 	uint8_t		color[4];
 } drawVert_s;
 
+// a tessellated MST_PATCH, coarser lods use every 2nd, 4th, ... vertex
+typedef struct {
+	uint32_t	surface;
+	uint32_t	firstVert;	// in the vertex pool
+	uint32_t	width, height;	// vertices at the finest lod
+	uint32_t	numLods;
+	float		errors[PATCH_MAX_LODS];
+	float		mins[3];
+	float		maxs[3];
+} patchgrid_s;
+
+typedef struct {
+	uint32_t	first;
+	uint32_t	count;
+} surfrange_s;
+
+// the surfaces in the pvs of a cluster and in the areas connected to area
+typedef struct {
+	int32_t		cluster;	// -1 for everything
+	int32_t		area;		// -1 for all areas
+	uint32_t	flood;		// areaflood of area when built, stale once it changes
+	uint32_t	lastused;	// visframe of the last lookup, for the lru
+	uint32_t	numsurfaces;
+	std::vector<surfrange_s>	ranges;	// sorted runs of consecutive surfaces
+} clustersurfs_s;
+
+// a pair of areas that are connected while the portal is open
+typedef struct {
+	uint32_t	area[2];
+	float		mins[3];	// of the areaportal brush
+	float		maxs[3];
+	bool		open;
+} areaportal_s;
+
+// a node of the flattened tree, 32 bytes so two share a cache line
+typedef struct {
+	float		normal[3];
+	float		dist;
+	int32_t		children[2];	// node, or -1 - leaf
+	uint32_t	type;		// axis of the normal, or PLANE_NONAXIAL
+	uint32_t	pad;
+} cnode_s;
+
+// a brush as the traces use it, its side planes are in blocks of four
+typedef struct {
+	uint32_t	firstBlock;	// in brushplanes, 16 floats each
+	uint32_t	firstSide;	// in brushsides
+	uint32_t	numSides;
+	uint32_t	contents;
+} cbrush_s;
+
+// result of a trace
+typedef struct {
+	float		fraction;	// how far it got, 1 if nothing was hit
+	float		endpos[3];
+	dplane_s	plane;		// of the side that was hit
+	int32_t		side;		// brushside that was hit, -1 if none
+	uint32_t	contents;	// of the brush that was hit
+	uint32_t	surfaceFlags;
+	bool		startsolid;	// started inside a brush
+	bool		allsolid;	// never got out of it
+} trace_s;
+
+typedef struct {
+	float		start[3];
+	float		end[3];
+} ray_s;
+
+typedef struct {
+	float		fraction;	// 1 if nothing was hit, 0 if it started in a brush
+	int32_t		side;		// brushside that was hit, -1 if none or startsolid
+	uint32_t	contents;	// of the brush that was hit
+	bool		startsolid;	// started in a brush, even if it got out of it
+} rayhit_s;
+
+// state of one trace, on the stack of the caller
+typedef struct {
+	float		start[3];	// of the box center
+	float		end[3];
+	float		extents[3];	// half the box size, zero for rays
+	uint32_t	contentmask;
+	trace_s		trace;
+	// the last TRACE_CHECKED brushes tested, a brush is in every leaf it touches
+	uint32_t	checked[TRACE_CHECKED];
+	uint32_t	numchecked;
+} tracework_s;
+
 typedef struct {
 	// int
 	lumpdefs_e	lumptype;
 	uint_t		blocksize;
 	// out
 	uint_t		*numblocks;
-	void		**ptr;
+	const void	**ptr;
 } lumpdata_s;
 
 class bspmap
 {
 public:
 	void getVertexData( renderdata_s *renderData );
-	bspmap( const char* mname )
+	uint32_t checksum( void ) const { return header.checksum; }
+	// visibility
+	int pointleaf( const float *pos ) const;
+	void benchpointleaf( int count ) const;
+	const uint8_t *clustervis( int cluster ) const;
+	// frustum may be NULL, otherwise FRUSTUM_PLANES planes facing inwards
+	void visiblesurfaces( const float *pos, const dplane_s *frustum, std::vector<uint32_t> *out );
+	// area portals, visiblesurfaces only returns the areas connected to the camera's
+	uint_t numareaportals( void ) const { return areaportals.size(); }
+	const areaportal_s *areaportal( uint_t num ) const { return &areaportals[num]; }
+	void setareaportal( uint_t num, bool open );
+	int nearestareaportal( const float *pos ) const;
+	bool areasconnected( int area1, int area2 ) const;
+	// changes whenever areas get connected or separated
+	uint32_t areastate( void ) const { return areastamp; }
+	// collision, mins and maxs may be NULL for a ray. safe to call from several threads
+	void trace( trace_s *tr, const float *start, const float *end,
+			const float *mins, const float *maxs, uint32_t contentmask ) const;
+	// count rays at once, spread over a pool of workers
+	void tracerays( const ray_s *rays, rayhit_s *hits, size_t count, uint32_t contentmask ) const;
+	bspmap( const char* mname, fsmode_e mode = FS_MMAP, bool parallel = true ) :
+		parallelload(parallel),
+		mapfile(NULL),
+		lastviscache(0),
+		cnodes(NULL),
+		numcnodes(0),
+		floodnum(0),
+		areamark(0),
+		areastamp(0)
 	{
-		if (mname!=NULL) open(mname);
+		memset( lumpbuffers, 0, sizeof(lumpbuffers) );
+		if (mname!=NULL) open(mname,mode);
 	}
 	~bspmap()
 	{
 		close();
 	}
 protected:
-	void open( const char* mname );
+	void open( const char* mname, fsmode_e mode );
 	void close( void );
 	
 	void load_lump( lumpdata_s *lump );
+	void load_lumps_parallel( lumpdata_s *lumplist, int numlumps );
 	void load_all_lumps( void );
+	void load_visibility( void );
+	void load_patches( void );
+	uint_t patchindexes( const patchgrid_s *grid, uint_t lod, uint32_t *out ) const;
+	const clustersurfs_s *clustersurfaces( int cluster, int area );
+	void cullsurfaces( const clustersurfs_s *entry, const dplane_s *frustum, std::vector<uint32_t> *out ) const;
+	void load_tree( void );
+	int pointleaf_dnode( const float *pos ) const;
+	void load_brushes( void );
+	void boxleafs( const float *mins, const float *maxs, int32_t num, std::vector<uint32_t> *out ) const;
+	void load_areaportals( void );
+	bool floodareas( uint32_t area, uint32_t flood, int stop );
+	void tracenode( tracework_s *tw, int32_t num, float p1f, float p2f, const float *p1, const float *p2 ) const;
+	void traceleaf( tracework_s *tw, const dleaf_s *leaf ) const;
+	void tracebrush( tracework_s *tw, const cbrush_s *brush ) const;
+	void tracepacket( tracework_s *tw, const float (*start)[RAY_PACKET], const float (*end)[RAY_PACKET],
+			int32_t num, int lanes ) const;
+	void traceraybatch( const ray_s *rays, rayhit_s *hits, size_t count, uint32_t contentmask ) const;
 	// vars
+	bool		parallelload;
 	filestream	*mapfile;
 	bspheader_s	header;
 	lump_s		lumps[lump_max];
-	// allocated (must add in load_all_lumps and close)
-	dleaf_s		*leafs;
-	dnode_s		*nodes;
-	uint32_t	*leafsurfaces;
-	dsurface_s	*surfaces;
-	drawVert_s	*drawverts;
-	uint32_t	*drawindexes;
-	dshader_s	*shaders;
-	uint8_t		*lightmapdata;
-	dplane_s	*planes;
-	char		*entitystring;
+	// read-only lump views, either into the mapped file or into lumpbuffers
+	const dleaf_s		*leafs;
+	const dnode_s		*nodes;
+	const uint32_t		*leafsurfaces;
+	const dsurface_s	*surfaces;
+	const drawVert_s	*drawverts;
+	const uint32_t		*drawindexes;
+	const dshader_s		*shaders;
+	const uint8_t		*lightmapdata;
+	const dplane_s		*planes;
+	const char		*entitystring;
+	const uint8_t		*visdata;
+	const dbrush_s		*brushes;
+	const dbrushside_s	*brushsides;
+	const uint32_t		*leafbrushes;
+	// lumps that had to be copied (not mapped), freed in close
+	void		*lumpbuffers[lump_max];
 	// counters
 	uint_t		numshaders;
 	uint_t		entitystringlen;
@@ -207,6 +380,45 @@ protected:
 	uint_t		numdrawindexes;
 	uint_t		numlightmaps;
 	uint_t		numplanes;
+	uint_t		numvisbytes;
+	uint_t		numbrushes;
+	uint_t		numbrushsides;
+	uint_t		numleafbrushes;
+	// pvs, one row of clusterbytes per cluster
+	const uint8_t	*visrows;
+	uint_t		numvisclusters;
+	uint_t		clusterbytes;
+	// surface marks to collect each surface of a pvs once, visframe counts the lookups
+	std::vector<uint32_t>	surfacemarks;
+	uint32_t	visframe;
+	// surfaces not referenced by any leaf, e.g. brush models
+	std::vector<uint32_t>	unleafedsurfaces;
+	// surface bounds as six arrays of numsurfaces floats (minx.., miny.., ..., maxz..)
+	std::vector<float>	surfbounds;
+	// pvs surface lists of the recently visited clusters
+	std::vector<clustersurfs_s>	viscache;
+	size_t		lastviscache;
+	// curved surfaces, their vertices in vertexpool are numbered after the drawverts
+	std::vector<patchgrid_s>	patchgrids;
+	std::vector<drawVert_s>	vertexpool;
+	// the nodes with their planes inline, breadth first, cnodes is cache line aligned
+	std::vector<uint8_t>	cnodebuffer;
+	const cnode_s		*cnodes;
+	uint_t			numcnodes;
+	// brushes with their side planes as nx[4], ny[4], nz[4], dist[4] blocks
+	std::vector<cbrush_s>	cbrushes;
+	std::vector<float>	brushplanes;
+	// area portals, the portals of area a are areaportalrefs[areaportalfirst[a]..areaportalfirst[a+1]]
+	std::vector<areaportal_s>	areaportals;
+	std::vector<uint32_t>	areaportalfirst;
+	std::vector<uint32_t>	areaportalrefs;
+	// connected areas share an areaflood, each flood gets a new number from floodnum
+	std::vector<uint32_t>	areaflood;
+	uint32_t	floodnum;
+	std::vector<uint32_t>	areamarks;
+	uint32_t	areamark;
+	std::vector<uint32_t>	areastack;
+	uint32_t	areastamp;
 };
 
 #endif // BSPMAP_H
@@ -0,0 +1,185 @@
+/*
+ * bsppatch.cpp - curved surface tessellation
+ *
+ * Copyright (C) 2014 Michael Rieder
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "main.h"
+#include "bspmap.h"
+
+// |p0 - 2 p1 + p2|, how far a quadratic bezier bends away from its chord
+static float secondDifference( const drawVert_s *p0, const drawVert_s *p1, const drawVert_s *p2 )
+{
+	float len = 0;
+	for (int c=0;c<3;c++) {
+		float d = p0->xyz[c] - 2*p1->xyz[c] + p2->xyz[c];
+		len += d*d;
+	}
+	return sqrtf( len );
+}
+
+// weighted sum of three control points, the weights add up to one
+static void blendVerts( drawVert_s *out, const drawVert_s **in, const float *w )
+{
+	float color[4] = { 0, 0, 0, 0 };
+	memset( out, 0, sizeof(*out) );
+	for (int k=0;k<3;k++) {
+		for (int c=0;c<3;c++) {
+			out->xyz[c] += w[k]*in[k]->xyz[c];
+			out->normal[c] += w[k]*in[k]->normal[c];
+		}
+		for (int c=0;c<2;c++) {
+			out->st[c] += w[k]*in[k]->st[c];
+			out->lightmap[c] += w[k]*in[k]->lightmap[c];
+		}
+		for (int c=0;c<4;c++)
+			color[c] += w[k]*in[k]->color[c];
+	}
+	for (int c=0;c<4;c++)
+		out->color[c] = (uint8_t)std::min( color[c] + 0.5f, 255.0f );
+}
+
+/*
+================
+bspmap::load_patches
+
+tessellate the MST_PATCH control grids. a grid of patchWidth by
+patchHeight points is made of 3x3 biquadratic pieces sharing their
+edges. each piece gets the fewest segments, a power of two, that keep
+the error below the surface's subdivisions. halving the segment count
+gives the coarser lods, so all of them index the same vertices
+================
+*/
+void bspmap::load_patches( void )
+{
+	patchgrids.clear();
+	std::vector<drawVert_s> patchverts;
+
+	for (uint_t k=0;k<numsurfaces;k++) {
+		const dsurface_s *surf = surfaces + k;
+		if (surf->surfaceType != MST_PATCH)
+			continue;
+		uint_t cw = surf->patchWidth, ch = surf->patchHeight;
+		if (cw < 3 || ch < 3 || !(cw & 1) || !(ch & 1) || cw*ch != surf->numVerts
+				|| surf->firstVert + surf->numVerts > numdrawverts) {
+			con_printf( "%i bad patch %ix%i\n", k, cw, ch );
+			continue;
+		}
+		const drawVert_s *ctrl = drawverts + surf->firstVert;
+
+		// the bend along each direction bounds the error of the linear segments,
+		// with n segments per piece it is at most bend / (4 n^2)
+		float bendu = 0, bendv = 0;
+		for (uint_t j=0;j<ch;j++)
+			for (uint_t i=0;i+2<cw;i+=2)
+				bendu = std::max( bendu, secondDifference( ctrl+j*cw+i, ctrl+j*cw+i+1, ctrl+j*cw+i+2 ) );
+		for (uint_t i=0;i<cw;i++)
+			for (uint_t j=0;j+2<ch;j+=2)
+				bendv = std::max( bendv, secondDifference( ctrl+j*cw+i, ctrl+(j+1)*cw+i, ctrl+(j+2)*cw+i ) );
+		float bend = bendu + bendv;
+
+		float maxerror = surf->subdivisions > 0 ? surf->subdivisions : PATCH_SUBDIVISIONS;
+		uint_t segments = 1;
+		while (segments < PATCH_MAX_SEGMENTS && bend / (4*segments*segments) > maxerror)
+			segments *= 2;
+
+		patchgrid_s grid;
+		grid.surface = k;
+		grid.firstVert = numdrawverts + patchverts.size();
+		grid.width = (cw-1)/2*segments + 1;
+		grid.height = (ch-1)/2*segments + 1;
+		grid.numLods = 0;
+		for (uint_t s=segments;s>=1 && grid.numLods<PATCH_MAX_LODS;s/=2)
+			grid.errors[grid.numLods++] = bend / (4*s*s);
+		for (int c=0;c<3;c++) {
+			grid.mins[c] = ctrl[0].xyz[c];
+			grid.maxs[c] = ctrl[0].xyz[c];
+		}
+
+		for (uint_t y=0;y<grid.height;y++) {
+			uint_t pv = std::min( y/segments, (ch-1)/2-1 );
+			float tv = (float)(y - pv*segments) / segments;
+			float wv[3] = { (1-tv)*(1-tv), 2*tv*(1-tv), tv*tv };
+			for (uint_t x=0;x<grid.width;x++) {
+				uint_t pu = std::min( x/segments, (cw-1)/2-1 );
+				float tu = (float)(x - pu*segments) / segments;
+				float wu[3] = { (1-tu)*(1-tu), 2*tu*(1-tu), tu*tu };
+
+				// blend the three rows of the piece, then the results
+				drawVert_s rows[3];
+				for (int r=0;r<3;r++) {
+					const drawVert_s *row = ctrl + (2*pv+r)*cw + 2*pu;
+					const drawVert_s *in[3] = { row, row+1, row+2 };
+					blendVerts( rows+r, in, wu );
+				}
+				const drawVert_s *in[3] = { rows, rows+1, rows+2 };
+				drawVert_s v;
+				blendVerts( &v, in, wv );
+
+				float len = sqrtf( v.normal[0]*v.normal[0] + v.normal[1]*v.normal[1] + v.normal[2]*v.normal[2] );
+				if (len > 0)
+					for (int c=0;c<3;c++)
+						v.normal[c] /= len;
+				for (int c=0;c<3;c++) {
+					grid.mins[c] = std::min( grid.mins[c], v.xyz[c] );
+					grid.maxs[c] = std::max( grid.maxs[c], v.xyz[c] );
+				}
+				patchverts.push_back( v );
+			}
+		}
+		patchgrids.push_back( grid );
+	}
+
+	// numbered after the map's own vertices, which stay in the lump
+	vertexpool.swap( patchverts );
+	con_printf( "%i patches, %i patch vertices\n", (int)patchgrids.size(), (int)vertexpool.size() );
+}
+
+/*
+================
+bspmap::patchindexes
+
+triangles of a patch lod, using every 2^lod-th vertex of the grid.
+returns the number of indexes, out may be NULL to just count them
+================
+*/
+uint_t bspmap::patchindexes( const patchgrid_s *grid, uint_t lod, uint32_t *out ) const
+{
+	uint_t step = 1 << lod;
+	uint_t w = (grid->width-1) / step;
+	uint_t h = (grid->height-1) / step;
+	if (out) {
+		for (uint_t y=0;y<h;y++) {
+			for (uint_t x=0;x<w;x++) {
+				uint32_t v0 = grid->firstVert + y*step*grid->width + x*step;
+				uint32_t v1 = v0 + step;
+				uint32_t v2 = v0 + step*grid->width;
+				uint32_t v3 = v2 + step;
+				*out++ = v0; *out++ = v2; *out++ = v1;
+				*out++ = v1; *out++ = v2; *out++ = v3;
+			}
+		}
+	}
+	return w*h*6;
+}
@@ -0,0 +1,455 @@
+/*
+ * bsptrace.cpp - brush collision
+ *
+ * Copyright (C) 2014 Michael Rieder
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#include "main.h"
+#include "bspmap.h"
+
+#define BRUSH_PADDING_DIST	1e30f	// of the unused sides in a block, behind everything
+
+/*
+================
+bspmap::load_brushes
+
+copy the side planes of every brush into blocks of four, one array per
+component, so a trace tests four sides at once. brushes with sides or
+planes out of range get no contents and are never hit
+================
+*/
+void bspmap::load_brushes( void )
+{
+	cbrushes.resize( numbrushes );
+	brushplanes.clear();
+	uint_t bad = 0;
+
+	for (uint_t k=0;k<numbrushes;k++) {
+		const dbrush_s *b = brushes + k;
+		cbrush_s *cb = &cbrushes[k];
+		cb->firstBlock = brushplanes.size() / 16;
+		cb->firstSide = b->firstSide;
+		cb->numSides = 0;
+		cb->contents = 0;
+
+		bool ok = b->firstSide <= numbrushsides && b->numSides <= numbrushsides - b->firstSide;
+		for (uint_t j=0;j<b->numSides && ok;j++)
+			ok = brushsides[b->firstSide+j].planeNum < numplanes;
+		if (!ok) {
+			bad++;
+			continue;
+		}
+
+		cb->numSides = b->numSides;
+		cb->contents = b->shaderNum < numshaders ? shaders[b->shaderNum].contentFlags : 0;
+		for (uint_t j=0;j<cb->numSides;j+=4) {
+			float block[16];
+			for (uint_t l=0;l<4;l++) {
+				const dplane_s *plane = NULL;
+				if (j+l < cb->numSides)
+					plane = planes + brushsides[cb->firstSide+j+l].planeNum;
+				for (int c=0;c<3;c++)
+					block[4*c+l] = plane ? plane->normal[c] : 0;
+				block[12+l] = plane ? plane->dist : BRUSH_PADDING_DIST;
+			}
+			brushplanes.insert( brushplanes.end(), block, block+16 );
+		}
+	}
+	if (bad)
+		con_printf( "%i bad brushes\n", bad );
+	con_printf( "%i brushes, %i brushsides, %i leafbrushes\n", numbrushes, numbrushsides, numleafbrushes );
+}
+
+/*
+================
+bspmap::tracebrush
+
+clip the move against one convex brush, as the sides are planes facing
+out, the box is inside the brush where it is behind all of them
+================
+*/
+void bspmap::tracebrush( tracework_s *tw, const cbrush_s *brush ) const
+{
+	float enterfrac = -1, leavefrac = 1;
+	int leadside = -1;
+	bool startout = false, getout = false;
+	const float *block = brushplanes.data() + 16*brush->firstBlock;
+
+	for (uint_t j=0;j<brush->numSides;j+=4, block+=16) {
+		// distances of start and end to four sides, pushed out by the box
+		float d1[4], d2[4];
+#if defined(__SSE__)
+		__m128 zero = _mm_setzero_ps();
+		__m128 dist = _mm_loadu_ps( block+12 );
+		__m128 dot1 = _mm_setzero_ps();
+		__m128 dot2 = _mm_setzero_ps();
+		for (int c=0;c<3;c++) {
+			__m128 n = _mm_loadu_ps( block+4*c );
+			__m128 absn = _mm_max_ps( n, _mm_sub_ps( zero, n ) );
+			dist = _mm_add_ps( dist, _mm_mul_ps( absn, _mm_set1_ps( tw->extents[c] ) ) );
+			dot1 = _mm_add_ps( dot1, _mm_mul_ps( n, _mm_set1_ps( tw->start[c] ) ) );
+			dot2 = _mm_add_ps( dot2, _mm_mul_ps( n, _mm_set1_ps( tw->end[c] ) ) );
+		}
+		_mm_storeu_ps( d1, _mm_sub_ps( dot1, dist ) );
+		_mm_storeu_ps( d2, _mm_sub_ps( dot2, dist ) );
+#else
+		for (int l=0;l<4;l++) {
+			float dist = block[12+l];
+			d1[l] = d2[l] = 0;
+			for (int c=0;c<3;c++) {
+				float n = block[4*c+l];
+				dist += fabsf( n ) * tw->extents[c];
+				d1[l] += n * tw->start[c];
+				d2[l] += n * tw->end[c];
+			}
+			d1[l] -= dist;
+			d2[l] -= dist;
+		}
+#endif
+		for (uint_t l=0;l<4 && j+l<brush->numSides;l++) {
+			if (d2[l] > 0)
+				getout = true;
+			if (d1[l] > 0)
+				startout = true;
+			// in front of this side all the way, the brush can't be touched
+			if (d1[l] > 0 && (d2[l] >= SURFACE_CLIP_EPSILON || d2[l] >= d1[l]))
+				return;
+			if (d1[l] <= 0 && d2[l] <= 0)
+				continue;
+			if (d1[l] > d2[l]) {
+				// entering, stop a little in front of the side
+				float f = std::max( (d1[l] - SURFACE_CLIP_EPSILON) / (d1[l] - d2[l]), 0.0f );
+				if (f > enterfrac) {
+					enterfrac = f;
+					leadside = j + l;
+				}
+			} else {
+				float f = std::min( (d1[l] + SURFACE_CLIP_EPSILON) / (d1[l] - d2[l]), 1.0f );
+				leavefrac = std::min( leavefrac, f );
+			}
+		}
+	}
+
+	if (!startout) {
+		tw->trace.startsolid = true;
+		if (!getout) {
+			tw->trace.allsolid = true;
+			tw->trace.fraction = 0;
+			tw->trace.contents = brush->contents;
+		}
+		return;
+	}
+	if (leadside >= 0 && enterfrac < leavefrac && enterfrac < tw->trace.fraction) {
+		const dbrushside_s *side = brushsides + brush->firstSide + leadside;
+		tw->trace.fraction = enterfrac;
+		tw->trace.side = brush->firstSide + leadside;
+		tw->trace.plane = planes[side->planeNum];
+		tw->trace.contents = brush->contents;
+		tw->trace.surfaceFlags = side->shaderNum < numshaders ? shaders[side->shaderNum].surfaceFlags : 0;
+	}
+}
+
+void bspmap::traceleaf( tracework_s *tw, const dleaf_s *leaf ) const
+{
+	for (uint_t k=0;k<leaf->numLeafBrushes;k++) {
+		uint_t idx = leaf->firstLeafBrush + k;
+		if (idx >= numleafbrushes)
+			break;
+		uint32_t b = leafbrushes[idx];
+		if (b >= cbrushes.size() || !cbrushes[b].numSides || !(cbrushes[b].contents & tw->contentmask))
+			continue;
+		// tested in an earlier leaf already
+		uint32_t numchecked = std::min( tw->numchecked, (uint32_t)TRACE_CHECKED );
+		uint32_t c;
+		for (c=0;c<numchecked && tw->checked[c]!=b;c++)
+			;
+		if (c < numchecked)
+			continue;
+		tw->checked[tw->numchecked++ % TRACE_CHECKED] = b;
+		tracebrush( tw, &cbrushes[b] );
+		if (tw->trace.allsolid)
+			return;
+	}
+}
+
+/*
+================
+bspmap::tracenode
+
+walk the part of the tree the box sweeps through, from p1 at fraction
+p1f to p2 at p2f. where the box straddles a node plane both sides are
+visited, the near one first
+================
+*/
+void bspmap::tracenode( tracework_s *tw, int32_t num, float p1f, float p2f, const float *p1, const float *p2 ) const
+{
+	// something nearer was hit already
+	if (tw->trace.fraction <= p1f)
+		return;
+
+	if (num < 0) {
+		uint32_t leafnum = -1 - num;
+		if (leafnum < numleafs)
+			traceleaf( tw, leafs + leafnum );
+		return;
+	}
+
+	const cnode_s *node = cnodes + num;
+	float t1, t2, offset;
+	if (node->type < PLANE_NONAXIAL) {
+		t1 = p1[node->type] - node->dist;
+		t2 = p2[node->type] - node->dist;
+		offset = tw->extents[node->type];
+	} else {
+		t1 = t2 = -node->dist;
+		offset = 0;
+		for (int c=0;c<3;c++) {
+			t1 += p1[c] * node->normal[c];
+			t2 += p2[c] * node->normal[c];
+			offset += fabsf( node->normal[c] ) * tw->extents[c];
+		}
+	}
+
+	if (t1 >= offset + 1 && t2 >= offset + 1) {
+		tracenode( tw, node->children[0], p1f, p2f, p1, p2 );
+		return;
+	}
+	if (t1 < -offset - 1 && t2 < -offset - 1) {
+		tracenode( tw, node->children[1], p1f, p2f, p1, p2 );
+		return;
+	}
+
+	// the fractions where the box starts and stops touching the plane
+	int side;
+	float frac, frac2;
+	if (t1 < t2) {
+		float idist = 1.0f / (t1 - t2);
+		side = 1;
+		frac2 = (t1 + offset + SURFACE_CLIP_EPSILON) * idist;
+		frac = (t1 - offset + SURFACE_CLIP_EPSILON) * idist;
+	} else if (t1 > t2) {
+		float idist = 1.0f / (t1 - t2);
+		side = 0;
+		frac2 = (t1 - offset - SURFACE_CLIP_EPSILON) * idist;
+		frac = (t1 + offset + SURFACE_CLIP_EPSILON) * idist;
+	} else {
+		side = 0;
+		frac = 1;
+		frac2 = 0;
+	}
+	frac = std::min( std::max( frac, 0.0f ), 1.0f );
+	frac2 = std::min( std::max( frac2, 0.0f ), 1.0f );
+
+	float mid[3];
+	float midf = p1f + (p2f - p1f)*frac;
+	for (int c=0;c<3;c++)
+		mid[c] = p1[c] + frac*(p2[c] - p1[c]);
+	tracenode( tw, node->children[side], p1f, midf, p1, mid );
+
+	midf = p1f + (p2f - p1f)*frac2;
+	for (int c=0;c<3;c++)
+		mid[c] = p1[c] + frac2*(p2[c] - p1[c]);
+	tracenode( tw, node->children[side^1], midf, p2f, mid, p2 );
+}
+
+// the tree walk works on the box center and its half size
+static void tracework_init( tracework_s *tw, const float *start, const float *end,
+		const float *mins, const float *maxs, uint32_t contentmask )
+{
+	memset( tw, 0, sizeof(*tw) );
+	tw->trace.fraction = 1;
+	tw->trace.side = -1;
+	tw->contentmask = contentmask;
+	for (int c=0;c<3;c++) {
+		float center = mins && maxs ? 0.5f*(mins[c] + maxs[c]) : 0;
+		tw->extents[c] = mins && maxs ? 0.5f*(maxs[c] - mins[c]) : 0;
+		tw->start[c] = start[c] + center;
+		tw->end[c] = end[c] + center;
+	}
+}
+
+/*
+================
+bspmap::trace
+
+sweep the box mins..maxs (or a point) from start to end through the
+world brushes matching contentmask. works on the caller's stack only
+================
+*/
+void bspmap::trace( trace_s *tr, const float *start, const float *end,
+		const float *mins, const float *maxs, uint32_t contentmask ) const
+{
+	tracework_s tw;
+	tracework_init( &tw, start, end, mins, maxs, contentmask );
+
+	if (numcnodes)
+		tracenode( &tw, 0, 0, 1, tw.start, tw.end );
+	else if (numleafs)
+		traceleaf( &tw, leafs );
+
+	*tr = tw.trace;
+	for (int c=0;c<3;c++)
+		tr->endpos[c] = start[c] + tr->fraction*(end[c] - start[c]);
+}
+
+/*
+================
+bspmap::tracepacket
+
+walk the tree with up to RAY_PACKET rays, lanes marks the ones still
+in the packet. as long as the rays are on the same side of the node
+planes they are tested together, a ray crossing a plane leaves the
+packet and continues on its own with tracenode
+================
+*/
+void bspmap::tracepacket( tracework_s *tw, const float (*start)[RAY_PACKET], const float (*end)[RAY_PACKET],
+		int32_t num, int lanes ) const
+{
+	while (num >= 0) {
+		const cnode_s *node = cnodes + num;
+		int front = 0, back = 0;
+#if defined(__SSE__)
+		__m128 t1 = _mm_set1_ps( -node->dist );
+		__m128 t2 = t1;
+		for (int c=0;c<3;c++) {
+			__m128 n = _mm_set1_ps( node->normal[c] );
+			t1 = _mm_add_ps( t1, _mm_mul_ps( _mm_loadu_ps( start[c] ), n ) );
+			t2 = _mm_add_ps( t2, _mm_mul_ps( _mm_loadu_ps( end[c] ), n ) );
+		}
+		__m128 one = _mm_set1_ps( 1.0f );
+		__m128 minusone = _mm_set1_ps( -1.0f );
+		front = _mm_movemask_ps( _mm_and_ps( _mm_cmpge_ps( t1, one ), _mm_cmpge_ps( t2, one ) ) );
+		back = _mm_movemask_ps( _mm_and_ps( _mm_cmplt_ps( t1, minusone ), _mm_cmplt_ps( t2, minusone ) ) );
+#else
+		for (int l=0;l<RAY_PACKET;l++) {
+			float t1 = -node->dist, t2 = -node->dist;
+			for (int c=0;c<3;c++) {
+				t1 += start[c][l] * node->normal[c];
+				t2 += end[c][l] * node->normal[c];
+			}
+			if (t1 >= 1 && t2 >= 1)
+				front |= 1<<l;
+			else if (t1 < -1 && t2 < -1)
+				back |= 1<<l;
+		}
+#endif
+		front &= lanes;
+		back &= lanes;
+
+		int split = lanes & ~(front | back);
+		for (int l=0;l<RAY_PACKET;l++)
+			if (split & (1<<l))
+				tracenode( tw + l, num, 0, 1, tw[l].start, tw[l].end );
+
+		if (front && back)
+			tracepacket( tw, start, end, node->children[1], back );
+		else if (back) {
+			num = node->children[1];
+			lanes = back;
+			continue;
+		}
+		if (!front)
+			return;
+		num = node->children[0];
+		lanes = front;
+	}
+
+	uint32_t leafnum = -1 - num;
+	if (leafnum >= numleafs)
+		return;
+	for (int l=0;l<RAY_PACKET;l++)
+		if (lanes & (1<<l))
+			traceleaf( tw + l, leafs + leafnum );
+}
+
+// rays in packets of RAY_PACKET, on the calling thread
+void bspmap::traceraybatch( const ray_s *rays, rayhit_s *hits, size_t count, uint32_t contentmask ) const
+{
+	static const float origin[3] = { 0, 0, 0 };
+	for (size_t k=0;k<count;k+=RAY_PACKET) {
+		tracework_s tw[RAY_PACKET];
+		float start[3][RAY_PACKET], end[3][RAY_PACKET];
+		int lanes = 0;
+		for (size_t l=0;l<RAY_PACKET;l++) {
+			// unused lanes trace an empty ray at the origin
+			const ray_s *ray = k+l < count ? rays + k + l : NULL;
+			tracework_init( tw + l, ray ? ray->start : origin, ray ? ray->end : origin, NULL, NULL, contentmask );
+			for (int c=0;c<3;c++) {
+				start[c][l] = tw[l].start[c];
+				end[c][l] = tw[l].end[c];
+			}
+			if (ray)
+				lanes |= 1<<l;
+		}
+
+		if (numcnodes)
+			tracepacket( tw, start, end, 0, lanes );
+		else if (numleafs) {
+			for (size_t l=0;l<RAY_PACKET;l++)
+				if (lanes & (1<<l))
+					traceleaf( tw + l, leafs );
+		}
+
+		for (size_t l=0;l<RAY_PACKET && k+l<count;l++) {
+			// a ray leaving a brush has no line of sight either
+			hits[k+l].fraction = tw[l].trace.startsolid ? 0 : tw[l].trace.fraction;
+			hits[k+l].side = tw[l].trace.startsolid ? -1 : tw[l].trace.side;
+			hits[k+l].contents = tw[l].trace.contents;
+			hits[k+l].startsolid = tw[l].trace.startsolid;
+		}
+	}
+}
+
+/*
+================
+bspmap::tracerays
+
+trace count rays against the brushes matching contentmask. the workers
+take RAY_BATCH rays at a time, so neighbouring rays, which tend to
+follow the same path down the tree, end up in the same packets
+================
+*/
+void bspmap::tracerays( const ray_s *rays, rayhit_s *hits, size_t count, uint32_t contentmask ) const
+{
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		size_t first;
+		while ((first = next.fetch_add( RAY_BATCH )) < count)
+			traceraybatch( rays + first, hits + first, std::min( count - first, (size_t)RAY_BATCH ), contentmask );
+	};
+
+	size_t numbatches = (count + RAY_BATCH-1) / RAY_BATCH;
+	size_t numworkers = std::min( (size_t)std::max( std::thread::hardware_concurrency(), 1u ), numbatches );
+	std::vector<std::thread> pool;
+	for (size_t k=1;k<numworkers;k++)
+		pool.push_back( std::thread( worker ) );
+	worker();
+	for (size_t k=0;k<pool.size();k++)
+		pool[k].join();
+}
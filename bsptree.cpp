@@ -0,0 +1,183 @@
+/*
+ * bsptree.cpp - flattened node tree
+ *
+ * Copyright (C) 2014 Michael Rieder
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <chrono>
+#include <random>
+#include "main.h"
+#include "bspmap.h"
+
+/*
+================
+bspmap::load_tree
+
+copy the nodes breadth first into cnodes, with their planes inline.
+the upper levels, which every walk goes through, end up packed
+together at the front. planes along +x, +y or +z are marked for the
+single compare in pointleaf
+================
+*/
+void bspmap::load_tree( void )
+{
+	cnodes = NULL;
+	numcnodes = 0;
+	cnodebuffer.clear();
+	if (numnodes == 0)
+		return;
+
+	std::vector<int32_t> order( 1, 0 );
+	std::vector<int32_t> newindex( numnodes, -1 );
+	newindex[0] = 0;
+	for (size_t k=0;k<order.size();k++) {
+		const dnode_s *node = nodes + order[k];
+		for (int c=0;c<2;c++) {
+			int32_t child = (int32_t)node->children[c];
+			if (child >= 0 && (uint_t)child < numnodes && newindex[child] < 0) {
+				newindex[child] = order.size();
+				order.push_back( child );
+			}
+		}
+	}
+
+	numcnodes = order.size();
+	cnodebuffer.assign( numcnodes*sizeof(cnode_s) + CACHE_LINE, 0 );
+	uintptr_t base = reinterpret_cast<uintptr_t>( cnodebuffer.data() );
+	cnode_s *out = reinterpret_cast<cnode_s*>( (base + CACHE_LINE-1) & ~(uintptr_t)(CACHE_LINE-1) );
+	uint_t bad = 0;
+	for (uint_t k=0;k<numcnodes;k++) {
+		const dnode_s *node = nodes + order[k];
+		cnode_s *cn = out + k;
+		if (node->planeNum < numplanes) {
+			memcpy( cn->normal, planes[node->planeNum].normal, sizeof(cn->normal) );
+			cn->dist = planes[node->planeNum].dist;
+		} else
+			bad++;
+		cn->type = PLANE_NONAXIAL;
+		for (int c=0;c<3;c++)
+			if (cn->normal[c] == 1.0f && cn->normal[(c+1)%3] == 0 && cn->normal[(c+2)%3] == 0)
+				cn->type = c;
+		for (int c=0;c<2;c++) {
+			int32_t child = (int32_t)node->children[c];
+			if (child < 0)
+				cn->children[c] = child;
+			else if ((uint_t)child < numnodes)
+				cn->children[c] = newindex[child];
+			else {
+				cn->children[c] = -1;
+				bad++;
+			}
+		}
+	}
+	cnodes = out;
+	if (bad)
+		con_printf( "%i bad node planes or children\n", bad );
+}
+
+/*
+================
+bspmap::pointleaf
+
+walk the tree down to the leaf containing pos
+================
+*/
+int bspmap::pointleaf( const float *pos ) const
+{
+	int32_t num = 0;
+
+	if (numcnodes == 0)
+		return 0;
+	while (num >= 0) {
+		const cnode_s *node = cnodes + num;
+		float d;
+		if (node->type < PLANE_NONAXIAL)
+			d = pos[node->type] - node->dist;
+		else
+			d = pos[0]*node->normal[0] + pos[1]*node->normal[1]
+				+ pos[2]*node->normal[2] - node->dist;
+		num = node->children[d >= 0 ? 0 : 1];
+	}
+	return -1 - num;
+}
+
+// pointleaf on the nodes and planes as stored in the map
+int bspmap::pointleaf_dnode( const float *pos ) const
+{
+	int32_t num = 0;
+
+	if (numnodes == 0)
+		return 0;
+	while (num >= 0) {
+		const dnode_s *node = nodes + num;
+		const dplane_s *plane = planes + node->planeNum;
+		float d = pos[0]*plane->normal[0] + pos[1]*plane->normal[1]
+			+ pos[2]*plane->normal[2] - plane->dist;
+		num = (int32_t)node->children[d >= 0 ? 0 : 1];
+	}
+	return -1 - num;
+}
+
+/*
+================
+bspmap::benchpointleaf
+
+time pointleaf on the flattened tree against the walk over the map's
+own nodes, for count random points inside the world. prints the best
+of a few runs of each and checks that they agree
+================
+*/
+void bspmap::benchpointleaf( int count ) const
+{
+	typedef std::chrono::steady_clock clock;
+	const int runs = 5;
+	if (numnodes == 0 || count <= 0)
+		return;
+
+	std::mt19937 rng( 1 );
+	std::vector<float> points( 3*count );
+	for (int c=0;c<3;c++) {
+		std::uniform_real_distribution<float> coord( (int32_t)nodes[0].mins[c], (int32_t)nodes[0].maxs[c] );
+		for (int k=0;k<count;k++)
+			points[3*k+c] = coord( rng );
+	}
+
+	double best[2] = { 1e30, 1e30 };
+	int mismatches = 0;
+	volatile int sink = 0;
+	for (int r=0;r<runs;r++) {
+		for (int w=0;w<2;w++) {
+			int sum = 0;
+			clock::time_point start = clock::now();
+			for (int k=0;k<count;k++)
+				sum += w ? pointleaf( &points[3*k] ) : pointleaf_dnode( &points[3*k] );
+			std::chrono::duration<double, std::nano> elapsed = clock::now() - start;
+			best[w] = std::min( best[w], elapsed.count() / count );
+			sink = sink + sum;
+		}
+	}
+	for (int k=0;k<count;k++)
+		if (pointleaf( &points[3*k] ) != pointleaf_dnode( &points[3*k] ))
+			mismatches++;
+
+	con_printf( "pointleaf, %i points: dnode walk %.1f ns, flattened %.1f ns (%.2fx), %i mismatches\n",
+		count, best[0], best[1], best[0] / best[1], mismatches );
+}
@@ -0,0 +1,277 @@
+/*
+ * bspvis.cpp - BSP visibility and culling
+ *
+ * Copyright (C) 2014 Michael Rieder
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#include <float.h>
+#include <algorithm>
+#include "main.h"
+#include "bspmap.h"
+
+/*
+================
+bspmap::load_visibility
+
+the visibility lump holds an uncompressed bit matrix,
+one row per cluster after a small header
+================
+*/
+void bspmap::load_visibility( void )
+{
+	visrows = NULL;
+	numvisclusters = clusterbytes = 0;
+	if (visdata && numvisbytes >= 2*sizeof(uint32_t)) {
+		uint32_t vishdr[2];
+		memcpy( vishdr, visdata, sizeof(vishdr) );
+		if ((uint64_t)vishdr[0]*vishdr[1] <= numvisbytes - sizeof(vishdr)) {
+			numvisclusters = vishdr[0];
+			clusterbytes = vishdr[1];
+			visrows = visdata + sizeof(vishdr);
+		}
+		else
+			con_printf( "bad visibility lump\n" );
+	}
+	con_printf( "%i vis clusters, %i bytes per cluster\n", numvisclusters, clusterbytes );
+
+	// surfaces no leaf references are always drawn
+	std::vector<bool> leafed( numsurfaces, false );
+	for (uint_t k=0;k<numleafsurfaces;k++)
+		if (leafsurfaces[k] < numsurfaces)
+			leafed[leafsurfaces[k]] = true;
+	unleafedsurfaces.clear();
+	for (uint_t k=0;k<numsurfaces;k++)
+		if (!leafed[k])
+			unleafedsurfaces.push_back( k );
+
+	surfacemarks.assign( numsurfaces, 0 );
+	visframe = 0;
+	viscache.clear();
+
+	// structure of arrays surface bounds for the batched box tests. the
+	// control points of a patch enclose it, so its vertices do for all
+	// types. surfaces without vertices get an inside out box
+	surfbounds.resize( 6*numsurfaces );
+	for (uint_t i=0;i<numsurfaces;i++) {
+		const dsurface_s *surf = surfaces + i;
+		float mins[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+		float maxs[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		if (surf->firstVert <= numdrawverts && surf->numVerts <= numdrawverts - surf->firstVert) {
+			for (uint_t v=0;v<surf->numVerts;v++) {
+				const float *xyz = drawverts[surf->firstVert+v].xyz;
+				for (int c=0;c<3;c++) {
+					mins[c] = std::min( mins[c], xyz[c] );
+					maxs[c] = std::max( maxs[c], xyz[c] );
+				}
+			}
+		}
+		for (int c=0;c<3;c++) {
+			surfbounds[c*numsurfaces+i] = mins[c];
+			surfbounds[(3+c)*numsurfaces+i] = maxs[c];
+		}
+	}
+}
+
+// returns the pvs row of cluster or NULL if everything is visible from it
+const uint8_t *bspmap::clustervis( int cluster ) const
+{
+	if (visrows == NULL || cluster < 0 || (uint_t)cluster >= numvisclusters)
+		return NULL;
+	return visrows + cluster*clusterbytes;
+}
+
+/*
+================
+bspmap::clustersurfaces
+
+the surfaces in the pvs of a cluster and in the areas connected to area,
+sorted and merged into runs of consecutive surface numbers. built on
+first use and kept for the VIS_CACHE_CLUSTERS clusters looked up most
+recently. a list goes stale when a portal connects or separates its area
+================
+*/
+const clustersurfs_s *bspmap::clustersurfaces( int cluster, int area )
+{
+	visframe++;
+	uint32_t flood = area >= 0 ? areaflood[area] : 0;
+	size_t slot = viscache.size();
+	if (lastviscache < viscache.size() && viscache[lastviscache].cluster == cluster
+			&& viscache[lastviscache].area == area)
+		slot = lastviscache;
+	for (size_t k=0;k<viscache.size() && slot==viscache.size();k++) {
+		if (viscache[k].cluster == cluster && viscache[k].area == area)
+			slot = k;
+	}
+	if (slot < viscache.size() && viscache[slot].flood == flood) {
+		viscache[slot].lastused = visframe;
+		lastviscache = slot;
+		return &viscache[slot];
+	}
+
+	// rebuild a stale list in place, otherwise replace the least recently used
+	if (slot == viscache.size()) {
+		if (viscache.size() < VIS_CACHE_CLUSTERS)
+			viscache.resize( viscache.size() + 1 );
+		else {
+			slot = 0;
+			for (size_t k=1;k<viscache.size();k++)
+				if (viscache[k].lastused < viscache[slot].lastused)
+					slot = k;
+		}
+	}
+
+	// mark the surfaces of every leaf in the pvs, solid leafs have cluster -1
+	const uint8_t *vis = clustervis( cluster );
+	for (uint_t i=0;i<numleafs;i++) {
+		int32_t c = leafs[i].cluster;
+		if (c < 0 || (vis && !(vis[c>>3] & (1<<(c&7)))))
+			continue;
+		if (area >= 0 && leafs[i].area < numareas && areaflood[leafs[i].area] != flood)
+			continue;
+		for (uint_t j=0;j<leafs[i].numLeafSurfaces;j++) {
+			uint_t k = leafs[i].firstLeafSurface + j;
+			if (k < numleafsurfaces && leafsurfaces[k] < numsurfaces)
+				surfacemarks[leafsurfaces[k]] = visframe;
+		}
+	}
+	for (size_t k=0;k<unleafedsurfaces.size();k++)
+		surfacemarks[unleafedsurfaces[k]] = visframe;
+
+	clustersurfs_s *entry = &viscache[slot];
+	entry->cluster = cluster;
+	entry->area = area;
+	entry->flood = flood;
+	entry->lastused = visframe;
+	entry->numsurfaces = 0;
+	entry->ranges.clear();
+	for (uint_t k=0;k<numsurfaces;k++) {
+		if (surfacemarks[k] != visframe)
+			continue;
+		if (entry->ranges.empty() || entry->ranges.back().first + entry->ranges.back().count != k) {
+			surfrange_s range = { k, 0 };
+			entry->ranges.push_back( range );
+		}
+		entry->ranges.back().count++;
+		entry->numsurfaces++;
+	}
+	lastviscache = slot;
+	return entry;
+}
+
+/*
+================
+bspmap::cullsurfaces
+
+append the surfaces of a cached list that are inside the frustum, the
+surfaces of a run are consecutive in surfbounds and tested four at once
+================
+*/
+void bspmap::cullsurfaces( const clustersurfs_s *entry, const dplane_s *frustum, std::vector<uint32_t> *out ) const
+{
+	const float *bounds[6];
+	for (int c=0;c<6;c++)
+		bounds[c] = surfbounds.data() + c*numsurfaces;
+
+	for (size_t r=0;r<entry->ranges.size();r++) {
+		const surfrange_s *range = &entry->ranges[r];
+		for (uint32_t k=0;k<range->count;k+=4) {
+			// a short tail repeats the last surface of the run
+			uint32_t first = range->first + k;
+			uint32_t num = std::min( range->count - k, 4u );
+			int visiblemask = 0xf;
+
+#if defined(__SSE__)
+			__m128 box[6];
+			for (int c=0;c<6;c++) {
+				if (num == 4)
+					box[c] = _mm_loadu_ps( bounds[c] + first );
+				else {
+					const float *b = bounds[c] + first;
+					box[c] = _mm_setr_ps( b[0], b[std::min( 1u, num-1 )], b[std::min( 2u, num-1 )], b[num-1] );
+				}
+			}
+			__m128 inside = _mm_cmpeq_ps( _mm_setzero_ps(), _mm_setzero_ps() );
+			for (int p=0;p<FRUSTUM_PLANES;p++) {
+				const dplane_s *plane = frustum + p;
+				// the box corner farthest along the plane normal
+				__m128 d = _mm_set1_ps( -plane->dist );
+				for (int c=0;c<3;c++) {
+					__m128 corner = plane->normal[c] >= 0 ? box[3+c] : box[c];
+					d = _mm_add_ps( d, _mm_mul_ps( corner, _mm_set1_ps( plane->normal[c] ) ) );
+				}
+				inside = _mm_and_ps( inside, _mm_cmpge_ps( d, _mm_setzero_ps() ) );
+			}
+			visiblemask = _mm_movemask_ps( inside );
+#else
+			for (uint32_t j=0;j<num;j++) {
+				for (int p=0;p<FRUSTUM_PLANES;p++) {
+					const dplane_s *plane = frustum + p;
+					float d = -plane->dist;
+					for (int c=0;c<3;c++)
+						d += bounds[plane->normal[c] >= 0 ? 3+c : c][first+j] * plane->normal[c];
+					if (d < 0) {
+						visiblemask &= ~(1<<j);
+						break;
+					}
+				}
+			}
+#endif
+			for (uint32_t j=0;j<num;j++)
+				if (visiblemask & (1<<j))
+					out->push_back( first + j );
+		}
+	}
+}
+
+/*
+================
+bspmap::visiblesurfaces
+
+collect the surfaces in the pvs of the cluster containing pos, in an
+area connected to its area and inside the frustum, sorted by surface
+number. while the camera stays in a cluster, only the frustum test of
+its cached list is left. from inside a wall everything is drawn
+================
+*/
+void bspmap::visiblesurfaces( const float *pos, const dplane_s *frustum, std::vector<uint32_t> *out )
+{
+	out->clear();
+	int cluster = -1, area = -1;
+	if (numleafs) {
+		const dleaf_s *leaf = leafs + pointleaf( pos );
+		cluster = leaf->cluster;
+		if (cluster >= 0 && !areaportals.empty() && leaf->area < numareas)
+			area = leaf->area;
+	}
+	const clustersurfs_s *entry = clustersurfaces( cluster, area );
+
+	if (frustum) {
+		cullsurfaces( entry, frustum, out );
+		return;
+	}
+	out->reserve( entry->numsurfaces );
+	for (size_t r=0;r<entry->ranges.size();r++)
+		for (uint32_t k=0;k<entry->ranges[r].count;k++)
+			out->push_back( entry->ranges[r].first + k );
+}
@@ -0,0 +1,139 @@
+/*
+ * demo.cpp - camera path recording
+ *
+ * Copyright (C) 2014 Michael Rieder
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <cstring>
+#include <algorithm>
+#include "main.h"
+#include "demo.h"
+
+/*
+================
+demo_write
+
+save a recorded camera path
+================
+*/
+bool demo_write( const char *filename, const std::vector<demoframe_s>& frames )
+{
+	FILE *f = fopen( filename, "wb" );
+	if (f == NULL) {
+		con_printf( "could not write demo %s\n", filename );
+		return false;
+	}
+
+	demoheader_s header;
+	memcpy( header.id, DEMO_ID, sizeof(header.id) );
+	header.version = DEMO_VERSION;
+	header.numframes = frames.size();
+	bool ok = fwrite( &header, sizeof(header), 1, f ) == 1;
+	if (ok && !frames.empty())
+		ok = fwrite( frames.data(), sizeof(demoframe_s), frames.size(), f ) == frames.size();
+	ok = fclose( f ) == 0 && ok;
+
+	if (ok)
+		con_printf( "wrote %i demo frames to %s\n", (int)frames.size(), filename );
+	else
+		con_printf( "error writing demo %s\n", filename );
+	return ok;
+}
+
+/*
+================
+demo_read
+
+load a camera path, through the virtual filesystem
+================
+*/
+bool demo_read( const char *filename, std::vector<demoframe_s> *frames )
+{
+	filestream f( filename, FS_READ );
+	demoheader_s header;
+
+	frames->clear();
+	if (!f.isopen() || f.read( &header, sizeof(header) ) != sizeof(header)) {
+		con_printf( "could not read demo %s\n", filename );
+		return false;
+	}
+	if (memcmp( header.id, DEMO_ID, sizeof(header.id) ) || header.version != DEMO_VERSION) {
+		con_printf( "%s is not a version %i demo\n", filename, DEMO_VERSION );
+		return false;
+	}
+	if ((uint64_t)header.numframes*sizeof(demoframe_s) > f.length() - sizeof(header)) {
+		con_printf( "demo %s is truncated\n", filename );
+		return false;
+	}
+
+	frames->resize( header.numframes );
+	if (header.numframes)
+		f.read( frames->data(), header.numframes*sizeof(demoframe_s) );
+	con_printf( "read %i demo frames from %s\n", header.numframes, filename );
+	return true;
+}
+
+/*
+================
+demo_resample
+
+the camera every timestep seconds along a recorded path, interpolated
+between the recorded frames around each time. the frame count of a
+timedemo then only depends on how long the recording is, not on the
+frame rate it was recorded at
+================
+*/
+void demo_resample( const std::vector<demoframe_s>& frames, float timestep, std::vector<demoframe_s> *out )
+{
+	out->clear();
+	if (frames.empty())
+		return;
+
+	float start = frames.front().time;
+	float length = frames.back().time - start;
+	size_t count = length > 0 ? (size_t)(length / timestep) + 1 : 1;
+	out->reserve( count );
+
+	size_t k = 0;
+	for (size_t n=0;n<count;n++) {
+		float time = start + n*timestep;
+		while (k+1 < frames.size() && frames[k+1].time <= time)
+			k++;
+		const demoframe_s& a = frames[k];
+		const demoframe_s& b = frames[std::min( k+1, frames.size()-1 )];
+		float span = b.time - a.time;
+		float f = span > 0 ? std::min( (time - a.time) / span, 1.0f ) : 0.0f;
+
+		demoframe_s frame;
+		frame.time = time - start;
+		for (int c=0;c<3;c++)
+			frame.origin[c] = a.origin[c] + f*(b.origin[c] - a.origin[c]);
+		// the horizontal angle wraps at 360, turn the short way
+		float turn = b.angles[0] - a.angles[0];
+		if (turn > 180.0f)
+			turn -= 360.0f;
+		else if (turn < -180.0f)
+			turn += 360.0f;
+		frame.angles[0] = a.angles[0] + f*turn;
+		frame.angles[1] = a.angles[1] + f*(b.angles[1] - a.angles[1]);
+		out->push_back( frame );
+	}
+}
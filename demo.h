@@ -0,0 +1,53 @@
+/*
+ * demo.h - camera path recording
+ *
+ * Copyright (C) 2014 Michael Rieder
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#ifndef DEMO_H
+#define DEMO_H
+
+#include <cstdint>
+#include <vector>
+
+#define DEMO_ID		"LBDM"
+#define DEMO_VERSION	1
+#define DEMO_TIMESTEP	(1.0f/60.0f)	// seconds between the frames of a timedemo
+
+typedef struct {
+	char		id[4];
+	uint32_t	version;
+	uint32_t	numframes;
+} demoheader_s;
+
+// the camera of one rendered frame, 24 bytes on disk
+typedef struct {
+	float		time;		// seconds since the recording started
+	float		origin[3];
+	float		angles[2];	// horizontal, vertical in degrees
+} demoframe_s;
+
+// demo.cpp
+bool demo_write( const char *filename, const std::vector<demoframe_s>& frames );
+bool demo_read( const char *filename, std::vector<demoframe_s> *frames );
+void demo_resample( const std::vector<demoframe_s>& frames, float timestep, std::vector<demoframe_s> *out );
+
+#endif // DEMO_H
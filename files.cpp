@@ -22,26 +22,424 @@
  * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
  */
 
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <vector>
 #include "main.h"
 
-void filestream::open( const char *fname )
+#define ZIP_EOCD_SIG		0x06054b50
+#define ZIP_CENTRAL_SIG		0x02014b50
+#define ZIP_LOCAL_SIG		0x04034b50
+#define ZIP_EOCD_LEN		22
+#define ZIP_CENTRAL_LEN		46
+#define ZIP_LOCAL_LEN		30
+#define ZIP_MAX_COMMENT		0xffff
+
+#define ZIP_STORED		0
+#define ZIP_DEFLATED		8
+
+// mounted archives, the hashed index over all of their files and the loose files
+static std::vector<filestream*>	fs_archives;
+static std::vector<fsentry_s>	fs_entries;
+static std::vector<int32_t>	fs_hashtable;	// open addressing, -1 is empty
+
+static inline uint16_t get16( const uint8_t *p )
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get32( const uint8_t *p )
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// lowercase with forward slashes, the way names are stored in the index
+static std::string fs_normalize( const char *name )
+{
+	std::string out( name );
+	for (size_t k=0;k<out.size();k++) {
+		if (out[k] == '\\')
+			out[k] = '/';
+		else
+			out[k] = tolower( (unsigned char)out[k] );
+	}
+	while (out.compare( 0, 2, "./" ) == 0)
+		out.erase( 0, 2 );
+	return out;
+}
+
+// FNV-1a
+static uint32_t fs_hash( const std::string& name )
+{
+	uint32_t h = 2166136261u;
+	for (size_t k=0;k<name.size();k++) {
+		h ^= (uint8_t)name[k];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int32_t *fs_findslot( const std::string& name )
+{
+	size_t mask = fs_hashtable.size() - 1;
+	size_t slot = fs_hash( name ) & mask;
+
+	while (fs_hashtable[slot] >= 0 && fs_entries[fs_hashtable[slot]].name != name)
+		slot = (slot + 1) & mask;
+	return &fs_hashtable[slot];
+}
+
+static void fs_rehash( size_t size )
+{
+	fs_hashtable.assign( size, -1 );
+	for (size_t k=0;k<fs_entries.size();k++)
+		*fs_findslot( fs_entries[k].name ) = k;
+}
+
+// later files replace earlier ones with the same name
+static void fs_addentry( const fsentry_s& entry )
+{
+	if (fs_hashtable.empty() || (fs_entries.size()+1)*2 > fs_hashtable.size())
+		fs_rehash( std::max( fs_hashtable.size()*2, (size_t)1024 ) );
+
+	int32_t *slot = fs_findslot( entry.name );
+	if (*slot >= 0) {
+		fs_entries[*slot] = entry;
+		return;
+	}
+	*slot = fs_entries.size();
+	fs_entries.push_back( entry );
+}
+
+/*
+================
+fs_addpk3
+
+index the central directory of a pk3
+================
+*/
+static int fs_addpk3( const std::string& path )
+{
+	filestream *pak = new filestream( path.c_str(), FS_MMAP );
+	if (!pak->mapped() || pak->length() < ZIP_EOCD_LEN) {
+		con_printf( "could not map %s\n", path.c_str() );
+		delete pak;
+		return 0;
+	}
+	const uint8_t *base = static_cast<const uint8_t*>(pak->view( 0, pak->length() ));
+	size_t len = pak->length();
+
+	// the end of central directory record sits behind an optional comment
+	const uint8_t *eocd = NULL;
+	size_t lowest = len > ZIP_EOCD_LEN+ZIP_MAX_COMMENT ? len-ZIP_EOCD_LEN-ZIP_MAX_COMMENT : 0;
+	for (size_t k=len-ZIP_EOCD_LEN+1;k-- > lowest;) {
+		if (get32( base+k ) == ZIP_EOCD_SIG) {
+			eocd = base + k;
+			break;
+		}
+	}
+	if (eocd == NULL) {
+		con_printf( "%s is not a zip file\n", path.c_str() );
+		delete pak;
+		return 0;
+	}
+
+	uint_t numfiles = get16( eocd+10 );
+	size_t cdoffset = get32( eocd+16 );
+	int archive = fs_archives.size();
+	int added = 0;
+
+	const uint8_t *cd = base + cdoffset;
+	for (uint_t k=0;k<numfiles;k++) {
+		if (cd+ZIP_CENTRAL_LEN > base+len || get32( cd ) != ZIP_CENTRAL_SIG) {
+			con_printf( "%s: broken central directory\n", path.c_str() );
+			break;
+		}
+		uint_t namelen = get16( cd+28 );
+		uint_t skiplen = namelen + get16( cd+30 ) + get16( cd+32 );
+		if (cd+ZIP_CENTRAL_LEN+namelen > base+len)
+			break;
+
+		std::string name( reinterpret_cast<const char*>(cd+ZIP_CENTRAL_LEN), namelen );
+		if (!name.empty() && name[name.size()-1] != '/') {
+			fsentry_s entry;
+			entry.name = fs_normalize( name.c_str() );
+			entry.archive = archive;
+			entry.method = get16( cd+10 );
+			entry.compressedlen = get32( cd+20 );
+			entry.length = get32( cd+24 );
+			entry.offset = get32( cd+42 );
+			fs_addentry( entry );
+			added++;
+		}
+		cd += ZIP_CENTRAL_LEN + skiplen;
+	}
+
+	fs_archives.push_back( pak );
+	return added;
+}
+
+static void fs_addloose( const std::string& dir, const std::string& prefix,
+		std::vector<fsentry_s> *loose, std::vector<std::string> *pk3s )
+{
+	DIR *d = opendir( dir.c_str() );
+	if (d == NULL)
+		return;
+
+	struct dirent *de;
+	while ((de = readdir( d )) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		std::string path = dir + "/" + de->d_name;
+		struct stat st;
+		if (stat( path.c_str(), &st ) < 0)
+			continue;
+		if (S_ISDIR(st.st_mode)) {
+			fs_addloose( path, prefix + de->d_name + "/", loose, NULL );
+			continue;
+		}
+		std::string name = fs_normalize( (prefix + de->d_name).c_str() );
+		if (pk3s && name.size() > 4 && name.compare( name.size()-4, 4, ".pk3" ) == 0) {
+			pk3s->push_back( path );
+			continue;
+		}
+		fsentry_s entry;
+		entry.name = name;
+		entry.path = path;
+		entry.archive = -1;
+		entry.offset = 0;
+		entry.compressedlen = entry.length = st.st_size;
+		entry.method = ZIP_STORED;
+		loose->push_back( entry );
+	}
+	closedir( d );
+}
+
+/*
+================
+fs_mount
+
+mount all pk3s in basedir in alphabetical order, so later archives
+override earlier ones, then the loose files on top of them
+================
+*/
+int fs_mount( const char *basedir )
+{
+	std::vector<std::string> pk3s;
+	std::vector<fsentry_s> loose;
+
+	fs_addloose( basedir, "", &loose, &pk3s );
+
+	std::sort( pk3s.begin(), pk3s.end() );
+	for (size_t k=0;k<pk3s.size();k++) {
+		int added = fs_addpk3( pk3s[k] );
+		con_printf( "%s: %i files\n", pk3s[k].c_str(), added );
+	}
+	for (size_t k=0;k<loose.size();k++)
+		fs_addentry( loose[k] );
+
+	con_printf( "mounted %s: %i pk3s, %i files\n", basedir,
+			(int)pk3s.size(), (int)fs_entries.size() );
+	return fs_entries.size();
+}
+
+void fs_shutdown( void )
 {
-	if (fname != NULL)
-		fp = fopen( fname, "rb" );
-	if (fp == NULL)
+	for (size_t k=0;k<fs_archives.size();k++)
+		delete fs_archives[k];
+	fs_archives.clear();
+	fs_entries.clear();
+	fs_hashtable.clear();
+}
+
+const fsentry_s *fs_findfile( const char *name )
+{
+	if (fs_hashtable.empty())
+		return NULL;
+	int32_t index = *fs_findslot( fs_normalize( name ) );
+	return index >= 0 ? &fs_entries[index] : NULL;
+}
+
+/*
+================
+filestream::openmapped
+
+map the whole file read-only, returns false if the
+file can't be mapped (pipes, empty files, ...)
+================
+*/
+bool filestream::openmapped( const char *fname )
+{
+	struct stat st;
+	void *base;
+	int fd;
+
+	fd = ::open( fname, O_RDONLY );
+	if (fd < 0)
+		return false;
+	if (fstat( fd, &st ) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		::close( fd );
+		return false;
+	}
+	base = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	// the mapping stays valid after the descriptor is gone
+	::close( fd );
+	if (base == MAP_FAILED)
+		return false;
+
+	mapping = base;
+	mapbase = static_cast<const uint8_t*>(base);
+	filelen = st.st_size;
+	mappos = 0;
+	return true;
+}
+
+/*
+================
+filestream::openentry
+
+stored pk3 entries are served straight out of the mapped archive.
+deflated ones are streamed, or inflated in one go if the caller
+asked for random access
+================
+*/
+bool filestream::openentry( const fsentry_s *entry, fsmode_e mode )
+{
+	if (entry->archive < 0) {
+		if (mode == FS_MMAP && openmapped( entry->path.c_str() ))
+			return true;
+		fp = fopen( entry->path.c_str(), "rb" );
+		filelen = entry->length;
+		return fp != NULL;
+	}
+
+	const filestream *pak = fs_archives[entry->archive];
+	const uint8_t *local = static_cast<const uint8_t*>(pak->view( entry->offset, ZIP_LOCAL_LEN ));
+	if (local == NULL || get32( local ) != ZIP_LOCAL_SIG)
+		return false;
+	size_t dataoffset = entry->offset + ZIP_LOCAL_LEN + get16( local+26 ) + get16( local+28 );
+	const uint8_t *data = static_cast<const uint8_t*>(pak->view( dataoffset, entry->compressedlen ));
+	if (data == NULL)
+		return false;
+
+	filelen = entry->length;
+	mappos = 0;
+	if (entry->method == ZIP_STORED) {
+		mapbase = data;
+		return true;
+	}
+	if (entry->method != ZIP_DEFLATED) {
+		con_printf( "%s: unsupported compression method %i\n", entry->name.c_str(), entry->method );
+		return false;
+	}
+
+	zs = new z_stream;
+	memset( zs, 0, sizeof(*zs) );
+	zdata = data;
+	zdatalen = entry->compressedlen;
+	// raw deflate data, no zlib header
+	if (inflateInit2( zs, -MAX_WBITS ) != Z_OK) {
+		delete zs;
+		zs = NULL;
+		return false;
+	}
+	zs->next_in = const_cast<Bytef*>(zdata);
+	zs->avail_in = zdatalen;
+
+	if (mode == FS_MMAP) {
+		inflated = new uint8_t[filelen];
+		size_t bytes = inflatebytes( inflated, filelen );
+		inflateEnd( zs );
+		delete zs;
+		zs = NULL;
+		if (bytes != filelen) {
+			con_printf( "%s: inflate failed\n", entry->name.c_str() );
+			delete[] inflated;
+			inflated = NULL;
+			return false;
+		}
+		mapbase = inflated;
+		mappos = 0;
+	}
+	return true;
+}
+
+void filestream::open( const char *fname, fsmode_e mode )
+{
+	if (fname == NULL)
+		return;
+
+	const fsentry_s *entry = fs_findfile( fname );
+	if (entry) {
+		if (!openentry( entry, mode ))
+			con_printf( "error opening %s\n", fname );
+		return;
+	}
+
+	if (mode == FS_MMAP && openmapped( fname ))
+		return;
+
+	fp = fopen( fname, "rb" );
+	if (fp == NULL) {
 		con_printf( "error opening %s\n", fname );
+		return;
+	}
+	fseek( fp, 0, SEEK_END );
+	filelen = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
 }
 
 void filestream::close( void )
 {
-	if (fp)
+	if (mapping) {
+		munmap( mapping, filelen );
+		mapping = NULL;
+	}
+	if (inflated) {
+		delete[] inflated;
+		inflated = NULL;
+	}
+	if (zs) {
+		inflateEnd( zs );
+		delete zs;
+		zs = NULL;
+	}
+	if (fp) {
 		fclose( fp );
+		fp = NULL;
+	}
+	mapbase = NULL;
+}
+
+size_t filestream::inflatebytes( void *buffer, size_t size )
+{
+	zs->next_out = static_cast<Bytef*>(buffer);
+	zs->avail_out = size;
+	while (zs->avail_out > 0) {
+		int err = inflate( zs, Z_SYNC_FLUSH );
+		if (err != Z_OK)
+			break;
+	}
+	size_t bytes = size - zs->avail_out;
+	mappos += bytes;
+	return bytes;
 }
 
 size_t filestream::read( void *buffer, size_t size )
 {
 	size_t bytes_read;
-	if (fp)
+	if (mapbase) {
+		bytes_read = std::min( size, filelen - mappos );
+		memcpy( buffer, mapbase + mappos, bytes_read );
+		mappos += bytes_read;
+	}
+	else if (zs)
+		bytes_read = inflatebytes( buffer, size );
+	else if (fp)
 		bytes_read = fread( buffer, 1, size, fp );
 	else
 		bytes_read = 0;
@@ -50,6 +448,28 @@ size_t filestream::read( void *buffer, size_t size )
 
 void filestream::seek( long int offset, bool relative )
 {
+	if (mapbase || zs) {
+		if (relative)
+			offset += mappos;
+		size_t target = std::min( (size_t)std::max( offset, 0L ), filelen );
+		if (mapbase) {
+			mappos = target;
+			return;
+		}
+		// deflate streams only go forward, start over to go back
+		if (target < mappos) {
+			inflateReset( zs );
+			zs->next_in = const_cast<Bytef*>(zdata);
+			zs->avail_in = zdatalen;
+			mappos = 0;
+		}
+		uint8_t scratch[4096];
+		while (mappos < target) {
+			if (inflatebytes( scratch, std::min( target-mappos, sizeof(scratch) ) ) == 0)
+				break;
+		}
+		return;
+	}
 	if (fp==NULL)
 		return;
 	if (relative==false)
@@ -57,3 +477,54 @@ void filestream::seek( long int offset, bool relative )
 	else
 		fseek( fp, offset, SEEK_CUR );
 }
+
+size_t filestream::tell( void ) const
+{
+	if (mapbase || zs)
+		return mappos;
+	if (fp)
+		return ftell( fp );
+	return 0;
+}
+
+bool filestream::eof( void ) const
+{
+	if (mapbase || zs)
+		return mappos >= filelen;
+	if (fp)
+		return feof( fp ) != 0;
+	return true;
+}
+
+size_t filestream::readat( void *buffer, size_t size, size_t offset )
+{
+	size_t bytes_read = 0;
+	if (mapbase) {
+		if (offset < filelen) {
+			bytes_read = std::min( size, filelen - offset );
+			memcpy( buffer, mapbase + offset, bytes_read );
+		}
+	}
+	else if (zs) {
+		seek( offset );
+		bytes_read = read( buffer, size );
+	}
+	else if (fp) {
+		int fd = fileno( fp );
+		while (bytes_read < size) {
+			ssize_t n = pread( fd, static_cast<uint8_t*>(buffer) + bytes_read,
+					size - bytes_read, offset + bytes_read );
+			if (n <= 0)
+				break;
+			bytes_read += n;
+		}
+	}
+	return bytes_read;
+}
+
+const void *filestream::view( size_t offset, size_t length ) const
+{
+	if (mapbase == NULL || offset > filelen || length > filelen - offset)
+		return NULL;
+	return mapbase + offset;
+}
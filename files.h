@@ -25,25 +25,76 @@
 #ifndef FILES_H
 #define FILES_H
 
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+typedef enum {
+	FS_READ,	// buffered stdio reads, works on pipes and odd filesystems
+	FS_MMAP		// whole file mapped read-only, lumps can be viewed in place
+} fsmode_e;
+
+// a file in the virtual filesystem, either inside a pk3 or loose on disk
+typedef struct {
+	std::string	name;		// lowercase, forward slashes
+	std::string	path;		// loose files: path on disk
+	int		archive;	// index of the pk3, -1 for loose files
+	uint32_t	offset;		// local header offset in the pk3
+	uint32_t	compressedlen;
+	uint32_t	length;
+	uint16_t	method;		// 0 stored, 8 deflated
+} fsentry_s;
+
+// files.cpp
+int fs_mount( const char *basedir );
+void fs_shutdown( void );
+const fsentry_s *fs_findfile( const char *name );
+
+struct z_stream_s;
+
 class filestream
 {
 public:
 	size_t read( void *buffer, size_t size );
 	void seek( long int offset, bool relative=false );
-	filestream( const char* fname = NULL )
+	// positional read, does not move the stream. safe to call from several
+	// threads unless the file is streamed out of a compressed pk3 entry
+	size_t readat( void *buffer, size_t size, size_t offset );
+	// returns a pointer into the mapped file or NULL if not mapped
+	const void *view( size_t offset, size_t length ) const;
+	bool mapped( void ) const { return mapbase != NULL; }
+	bool compressed( void ) const { return zs != NULL; }
+	bool isopen( void ) const { return fp || mapbase || zs; }
+	size_t length( void ) const { return filelen; }
+	size_t tell( void ) const;
+	bool eof( void ) const;
+	filestream( const char* fname = NULL, fsmode_e mode = FS_MMAP ) :
+		fp(NULL), mapbase(NULL), filelen(0), mappos(0),
+		mapping(NULL), inflated(NULL), zs(NULL), zdata(NULL), zdatalen(0)
 	{
-		if (fname!=NULL) open(fname);
+		if (fname!=NULL) open(fname,mode);
 	}
 	~filestream()
 	{
-		if (fp) close();
+		close();
 	}
 protected:
-	void open( const char* fname );
+	void open( const char* fname, fsmode_e mode );
+	bool openmapped( const char* fname );
+	bool openentry( const fsentry_s *entry, fsmode_e mode );
 	void close( void );
+	size_t inflatebytes( void *buffer, size_t size );
 	// vars
 	FILE *fp;
-	void *int_buffer;
+	const uint8_t *mapbase;		// random access data, see mapped()
+	size_t filelen;
+	size_t mappos;
+	void *mapping;			// our own mapping of a loose file
+	uint8_t *inflated;		// fully inflated pk3 entry
+	z_stream_s *zs;			// streamed pk3 entry
+	const uint8_t *zdata;
+	size_t zdatalen;
 };
 
 #endif // FILES_H
@@ -25,6 +25,8 @@
 #include <cstdarg>
 #include "main.h"
 #include "bspmap.h"
+#include "bspcache.h"
+#include "demo.h"
 #include "renderer.h"
 
 bspmap *worldmap;
@@ -41,19 +43,119 @@ void con_printf( const char *string, ... )
 	va_end(vl);
 }
 
+// maps/DM/mohdm2.bsp is cached in <basedir>/maps_DM_mohdm2.lbc
+static std::string cache_filename( const char *basedir, const char *mapname )
+{
+	std::string name( mapname );
+	size_t ext = name.rfind( '.' );
+	if (ext != std::string::npos && name.find( '/', ext ) == std::string::npos)
+		name.erase( ext );
+	std::replace( name.begin(), name.end(), '/', '_' );
+	return std::string( basedir ) + "/" + name + CACHE_EXT;
+}
+
+// what bspmap::getVertexData allocated
+static void free_renderdata( renderdata_s *renderData )
+{
+	delete[] renderData->layerData;
+	delete[] renderData->idxData;
+	delete[] renderData->surfRank;
+	delete[] renderData->rankFirstIndex;
+	delete[] renderData->batches;
+	delete[] renderData->patches;
+	delete[] renderData->patchLods;
+	delete[] renderData->texarray;
+}
+
 int main( int argc, char *argv[] )
 {
 	renderdata_s renderData;
-	const char *mapstring = "main/maps/DM/mohdm2.bsp";
-	
-	if (argc == 2)
-		mapstring = argv[1];
+	const char *mapstring = "maps/DM/mohdm2.bsp";
+	const char *basedir = "main";
+	fsmode_e fsmode = FS_MMAP;
+	bool parallel = true;
+	bool compact = false;
+	bool gpucull = true;
+	bool baked = true;
+	bool usecache = true;
+	bool headless = false;
+	HeadlessOptions headlessOptions;
+	const char *recordfile = NULL;
+	const char *timedemo = NULL;
+	const char *tracefile = NULL;
+	int benchleafs = 0;
+	std::vector<demoframe_s> path;
+
+	for (int k=1;k<argc;k++) {
+		if (strcmp(argv[k],"-nommap")==0)
+			fsmode = FS_READ;
+		else if (strcmp(argv[k],"-serial")==0)
+			parallel = false;
+		else if (strcmp(argv[k],"-compactverts")==0)
+			compact = true;
+		else if (strcmp(argv[k],"-nogpucull")==0)
+			gpucull = false;
+		else if (strcmp(argv[k],"-dynamiclights")==0)
+			baked = false;
+		else if (strcmp(argv[k],"-nocache")==0)
+			usecache = false;
+		else if (strcmp(argv[k],"-headless")==0)
+			headless = true;
+		else if (strcmp(argv[k],"-frames")==0 && k+1<argc)
+			headlessOptions.frames = atoi(argv[++k]);
+		else if (strcmp(argv[k],"-size")==0 && k+1<argc)
+			sscanf(argv[++k], "%ix%i", &headlessOptions.width, &headlessOptions.height);
+		else if (strcmp(argv[k],"-dump")==0 && k+1<argc)
+			headlessOptions.dumpPrefix = argv[++k];
+		else if (strcmp(argv[k],"-record")==0 && k+1<argc)
+			recordfile = argv[++k];
+		else if (strcmp(argv[k],"-timedemo")==0 && k+1<argc)
+			timedemo = argv[++k];
+		else if (strcmp(argv[k],"-trace")==0 && k+1<argc)
+			tracefile = argv[++k];
+		else if (strcmp(argv[k],"-benchleafs")==0 && k+1<argc)
+			benchleafs = atoi(argv[++k]);
+		else if (strcmp(argv[k],"-basedir")==0 && k+1<argc)
+			basedir = argv[++k];
+		else
+			mapstring = argv[k];
+	}
+
+	fs_mount(basedir);
+	if (timedemo && !demo_read(timedemo, &path)) {
+		fs_shutdown();
+		return EXIT_FAILURE;
+	}
+	worldmap = new bspmap(mapstring,fsmode,parallel);
+	// micro benchmark only, no renderer needed
+	if (benchleafs) {
+		worldmap->benchpointleaf( benchleafs );
+		delete worldmap;
+		fs_shutdown();
+		return EXIT_SUCCESS;
+	}
 
-	worldmap = new bspmap(mapstring);
-	worldmap->getVertexData( &renderData );
+	// a valid cache skips the tessellation, vertex expansion and texture decoding
+	std::string cachename = cache_filename( basedir, mapstring );
+	filestream *cache = NULL;
+	if (usecache)
+		cache = cache_load( cachename.c_str(), worldmap->checksum(), &renderData );
+	if (cache == NULL) {
+		worldmap->getVertexData( &renderData );
+		// bake a new one and start from it like a warm start would
+		if (usecache && cache_write( cachename.c_str(), worldmap->checksum(), &renderData )) {
+			renderdata_s cached;
+			cache = cache_load( cachename.c_str(), worldmap->checksum(), &cached );
+			if (cache) {
+				free_renderdata( &renderData );
+				renderData = cached;
+			}
+		}
+	}
 
-	r = new renderer("lazybee");
-	r->setVertexData( &renderData );
+	r = new renderer("lazybee", headless ? &headlessOptions : NULL);
+	r->setVertexData( &renderData, compact, gpucull, baked );
+	r->setWorld( worldmap );
 
 	con_printf( "============================================================\n" );
 	con_printf( "Renderer initialized\n" );
@@ -64,11 +166,25 @@ int main( int argc, char *argv[] )
 	con_printf( "GLSL version   : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION) );
 	con_printf( "============================================================\n" );
 
-	r->renderloop();
+	if (tracefile)
+		r->trace( tracefile );
+	if (timedemo)
+		r->runbenchmark( &path );
+	else if (headless)
+		r->runbenchmark( NULL );
+	else {
+		if (recordfile)
+			r->record( recordfile );
+		r->renderloop();
+	}
 
 	shutdown();
 
-	delete[] renderData.vtxData;
+	if (cache) {
+		delete[] renderData.texarray;
+		delete cache;
+	} else
+		free_renderdata( &renderData );
 	//con_printf( "successful!\n" );
 	return EXIT_SUCCESS;
 }
@@ -77,4 +193,5 @@ void shutdown( void )
 {
 	delete r;
 	delete worldmap;
+	fs_shutdown();
 }
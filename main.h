@@ -32,6 +32,7 @@
 #include <cstring>
 #include <cmath>
 #include <list>
+#include <vector>
 #include <sstream>
 #include <algorithm>
 
@@ -45,11 +46,58 @@ typedef float vec3[3];
 void con_printf( const char *string, ... );
 
 // common
+#define NO_LIGHTMAP	0xffff
+
+typedef struct {
+	uint32_t	surfaceType;
+	uint32_t	firstRank;	// run of surfaces in index buffer order
+	uint32_t	numRanks;
+} surfbatch_s;
+
+typedef struct {
+	uint32_t	firstIndex;	// in idxData
+	uint32_t	numIndexes;
+	float		error;		// farthest the triangles get from the curved surface
+} patchlod_s;
+
+typedef struct {
+	uint32_t	rank;		// its own index range holds the finest lod
+	uint32_t	firstLod;	// finest first
+	uint32_t	numLods;
+	float		mins[3];
+	float		maxs[3];
+} patchsurf_s;
+
+// a decoded texture, RGBA rows bottom up
+typedef struct {
+	uint32_t	width;		// 0 if it couldn't be decoded
+	uint32_t	height;
+	uint64_t	offset;		// in texData
+} textureimage_s;
+
 typedef struct {
-	float *		vtxData;
-	uint_t		vtxcount;
+	const void *	vtxData;	// the map's drawVert_s pool, followed by tessellated patches
+	uint_t		vtxcount;	// of the whole pool
+	const void *	patchVtxData;	// the last patchvtxcount vertices if not in vtxData, or NULL
+	uint_t		patchvtxcount;
+	const uint16_t *	layerData;	// per vertex texture array layer and lightmap layer (NO_LIGHTMAP)
+	const uint32_t *	idxData;	// triangles, already rebased to the pool
+	uint_t		idxcount;
+	const uint32_t *	surfRank;	// position of each surface in idxData
+	const uint32_t *	rankFirstIndex;	// where the surfaces start in idxData, by rank, surfcount+1 entries
+	uint_t		surfcount;
+	const surfbatch_s *	batches;	// surfaces sharing a surface type, sorted by shader inside
+	uint_t		batchcount;
+	const patchsurf_s *	patches;	// lod levels of the curved surfaces
+	uint_t		patchcount;
+	const patchlod_s *	patchLods;
+	uint_t		patchlodcount;
 	const char **	texarray;
 	uint_t		texcount;
+	const textureimage_s *	teximages;	// texcount textures baked into the map cache, or NULL
+	const uint8_t *	texData;
+	const uint8_t *	lightmapData;	// LIGHTMAP_SIZE square RGB pages
+	uint_t		lightmapcount;
 } renderdata_s;
 
 
@@ -0,0 +1,303 @@
+/*
+ * profile.cpp - frame timing
+ *
+ * Copyright (C) 2014 Michael Rieder
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include "main.h"
+#include "profile.h"
+
+static const char *stageNames[NUM_STAGES] = {
+	"update", "cull", "uniforms", "draw", "swap", "finish"
+};
+
+const char *profiler::stagename( int stage )
+{
+	return stage >= 0 && stage < NUM_STAGES ? stageNames[stage] : "?";
+}
+
+// ms since init
+double profiler::Now() const
+{
+	std::chrono::duration<double, std::milli> t = clock::now() - epoch;
+	return t.count();
+}
+
+/*
+================
+profiler::init
+
+needs the gl context for the timer queries, GL 3.3 or ARB_timer_query
+================
+*/
+void profiler::init( void )
+{
+	epoch = clock::now();
+	frameCount = 0;
+	active = -1;
+	for (int k=0;k<PROFILE_QUERY_SETS;k++)
+		queryFrame[k] = 0;
+
+	timerQueries = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+	if (timerQueries)
+		glGenQueries(PROFILE_QUERY_SETS * NUM_STAGES, &queries[0][0]);
+	else
+		con_printf( "no timer queries, gpu times unavailable\n" );
+}
+
+void profiler::shutdown( void )
+{
+	if (timerQueries)
+		glDeleteQueries(PROFILE_QUERY_SETS * NUM_STAGES, &queries[0][0]);
+	timerQueries = false;
+}
+
+/*
+================
+profiler::ReadQueries
+
+copy the gpu times of a query set into its frame. without wait,
+results the gpu hasn't finished yet are dropped instead of stalling
+================
+*/
+void profiler::ReadQueries( int set, bool wait )
+{
+	if (!timerQueries || queryFrame[set] == 0)
+		return;
+	uint32_t frame = queryFrame[set] - 1;
+	profframe_s *f = find( frame ) ? &history[frame % PROFILE_HISTORY] : NULL;
+	queryFrame[set] = 0;
+
+	for (int s=0;s<NUM_STAGES;s++) {
+		if (!queryIssued[set][s])
+			continue;
+		GLint available = GL_TRUE;
+		if (!wait)
+			glGetQueryObjectiv(queries[set][s], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			continue;
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(queries[set][s], GL_QUERY_RESULT, &ns);
+		if (f)
+			f->gpu[s] = ns / 1e6;
+	}
+}
+
+/*
+================
+profiler::beginframe
+
+starts a new entry in the ring buffer and collects the gpu times of
+the frame whose query set is about to be reused
+================
+*/
+void profiler::beginframe( void )
+{
+	if (active >= 0)
+		endframe();
+
+	int set = frameCount % PROFILE_QUERY_SETS;
+	ReadQueries( set, false );
+	queryFrame[set] = frameCount + 1;
+	for (int s=0;s<NUM_STAGES;s++)
+		queryIssued[set][s] = false;
+
+	profframe_s *f = &history[frameCount % PROFILE_HISTORY];
+	f->frame = frameCount++;
+	f->start = Now();
+	f->total = -1;
+	for (int s=0;s<NUM_STAGES;s++) {
+		f->stageStart[s] = 0;
+		f->cpu[s] = -1;
+		f->gpu[s] = -1;
+	}
+}
+
+void profiler::endframe( void )
+{
+	if (frameCount == 0)
+		return;
+	if (active >= 0)
+		end( active );
+	profframe_s *f = &history[(frameCount-1) % PROFILE_HISTORY];
+	f->total = Now() - f->start;
+}
+
+// stages don't nest, a time elapsed query can't run inside another
+void profiler::begin( int stage )
+{
+	if (frameCount == 0 || stage < 0 || stage >= NUM_STAGES)
+		return;
+	if (active >= 0)
+		end( active );
+
+	profframe_s *f = &history[(frameCount-1) % PROFILE_HISTORY];
+	f->stageStart[stage] = Now() - f->start;
+	if (timerQueries) {
+		int set = (frameCount-1) % PROFILE_QUERY_SETS;
+		glBeginQuery(GL_TIME_ELAPSED, queries[set][stage]);
+		queryIssued[set][stage] = true;
+	}
+	active = stage;
+}
+
+void profiler::end( int stage )
+{
+	if (stage != active)
+		return;
+	profframe_s *f = &history[(frameCount-1) % PROFILE_HISTORY];
+	f->cpu[stage] = Now() - f->start - f->stageStart[stage];
+	if (timerQueries)
+		glEndQuery(GL_TIME_ELAPSED);
+	active = -1;
+}
+
+// waits for all outstanding gpu times, e.g. at the end of a benchmark
+void profiler::flush( void )
+{
+	for (int k=0;k<PROFILE_QUERY_SETS;k++)
+		ReadQueries( k, true );
+}
+
+// the frame begun last
+const profframe_s& profiler::last( void ) const
+{
+	return history[(frameCount + PROFILE_HISTORY - 1) % PROFILE_HISTORY];
+}
+
+// NULL if the frame isn't in the ring buffer (anymore)
+const profframe_s* profiler::find( uint32_t frame ) const
+{
+	if (frame >= frameCount || frameCount - frame > PROFILE_HISTORY)
+		return NULL;
+	return &history[frame % PROFILE_HISTORY];
+}
+
+/*
+================
+profiler::summary
+
+average and worst of every stage over the frames in the ring buffer
+================
+*/
+void profiler::summary( void ) const
+{
+	double total = 0, worst = 0;
+	double cpu[NUM_STAGES] = { 0 }, cpuWorst[NUM_STAGES] = { 0 };
+	double gpu[NUM_STAGES] = { 0 }, gpuWorst[NUM_STAGES] = { 0 };
+	int cpuCount[NUM_STAGES] = { 0 }, gpuCount[NUM_STAGES] = { 0 };
+	int count = 0;
+
+	uint32_t first = frameCount > PROFILE_HISTORY ? frameCount - PROFILE_HISTORY : 0;
+	for (uint32_t k=first;k<frameCount;k++) {
+		const profframe_s *f = &history[k % PROFILE_HISTORY];
+		if (f->total < 0)
+			continue;	// still running
+		total += f->total;
+		worst = std::max( worst, f->total );
+		count++;
+		for (int s=0;s<NUM_STAGES;s++) {
+			if (f->cpu[s] >= 0) {
+				cpu[s] += f->cpu[s];
+				cpuWorst[s] = std::max( cpuWorst[s], f->cpu[s] );
+				cpuCount[s]++;
+			}
+			if (f->gpu[s] >= 0) {
+				gpu[s] += f->gpu[s];
+				gpuWorst[s] = std::max( gpuWorst[s], f->gpu[s] );
+				gpuCount[s]++;
+			}
+		}
+	}
+	if (count == 0)
+		return;
+
+	con_printf( "last %i frames: avg %.3f ms, worst %.3f ms\n", count, total / count, worst );
+	con_printf( "%-9s %10s %10s %10s %10s\n", "stage", "cpu avg", "cpu worst", "gpu avg", "gpu worst" );
+	for (int s=0;s<NUM_STAGES;s++) {
+		if (cpuCount[s] == 0)
+			continue;
+		if (gpuCount[s])
+			con_printf( "%-9s %10.3f %10.3f %10.3f %10.3f\n", stageNames[s],
+				cpu[s] / cpuCount[s], cpuWorst[s], gpu[s] / gpuCount[s], gpuWorst[s] );
+		else
+			con_printf( "%-9s %10.3f %10.3f %10s %10s\n", stageNames[s],
+				cpu[s] / cpuCount[s], cpuWorst[s], "-", "-" );
+	}
+}
+
+/*
+================
+profiler::writetrace
+
+the ring buffer in chrome's trace event format, for about:tracing or
+perfetto. the queries only give gpu durations, so each gpu stage is
+placed where it was submitted, but not before the previous one ended
+================
+*/
+bool profiler::writetrace( const char *filename ) const
+{
+	FILE *f = fopen( filename, "w" );
+	if (f == NULL) {
+		con_printf( "could not write trace %s\n", filename );
+		return false;
+	}
+
+	fprintf( f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+	fprintf( f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"cpu\"}},\n" );
+	fprintf( f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"gpu\"}}" );
+
+	int count = 0;
+	double gpuEnd = 0;
+	uint32_t first = frameCount > PROFILE_HISTORY ? frameCount - PROFILE_HISTORY : 0;
+	for (uint32_t k=first;k<frameCount;k++) {
+		const profframe_s *p = &history[k % PROFILE_HISTORY];
+		if (p->total < 0)
+			continue;
+		// trace timestamps are in microseconds
+		fprintf( f, ",\n{\"name\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}",
+			p->start * 1000, p->total * 1000, p->frame );
+		for (int s=0;s<NUM_STAGES;s++) {
+			if (p->cpu[s] < 0)
+				continue;
+			double start = p->start + p->stageStart[s];
+			fprintf( f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+				stageNames[s], start * 1000, p->cpu[s] * 1000 );
+			if (p->gpu[s] < 0)
+				continue;
+			start = std::max( start, gpuEnd );
+			gpuEnd = start + p->gpu[s];
+			fprintf( f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":%.3f,\"dur\":%.3f}",
+				stageNames[s], start * 1000, p->gpu[s] * 1000 );
+		}
+		count++;
+	}
+	fprintf( f, "\n]}\n" );
+
+	if (fclose( f ) != 0) {
+		con_printf( "error writing trace %s\n", filename );
+		return false;
+	}
+	con_printf( "wrote %i frames to trace %s\n", count, filename );
+	return true;
+}
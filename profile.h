@@ -0,0 +1,100 @@
+/*
+ * profile.h - frame timing
+ *
+ * Copyright (C) 2014 Michael Rieder
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <GL/glew.h>
+#include <chrono>
+#include <cstdint>
+
+#define PROFILE_HISTORY		1024	// frames kept in the ring buffer
+#define PROFILE_QUERY_SETS	2	// gpu times are read back this many frames late
+
+// timed stages of a frame, they run one after another
+enum {
+	STAGE_UPDATE,		// input and camera
+	STAGE_CULL,
+	STAGE_UNIFORMS,
+	STAGE_DRAW,		// issuing the draws
+	STAGE_SWAP,
+	STAGE_FINISH,		// waiting for the gpu, benchmarks only
+	NUM_STAGES
+};
+
+// one frame in the ring buffer, all times in ms
+typedef struct {
+	uint32_t	frame;
+	double		start;			// since the profiler was created
+	double		total;			// cpu time from beginframe to endframe
+	double		stageStart[NUM_STAGES];	// from the frame's start
+	double		cpu[NUM_STAGES];	// negative if the stage didn't run
+	double		gpu[NUM_STAGES];	// negative until read back, or without timer queries
+} profframe_s;
+
+/*
+ cpu and gpu time of every stage of the last PROFILE_HISTORY frames.
+ gpu times come from GL_TIME_ELAPSED queries, one set per frame in
+ flight, so reading them back never waits for the gpu
+ */
+class profiler
+{
+public:
+	void	init( void );
+	void	shutdown( void );
+	void	beginframe( void );
+	void	endframe( void );
+	void	begin( int stage );
+	void	end( int stage );
+	void	flush( void );
+	const profframe_s&	last( void ) const;
+	const profframe_s*	find( uint32_t frame ) const;
+	uint32_t	numframes( void ) const { return frameCount; }
+	void	summary( void ) const;
+	bool	writetrace( const char *filename ) const;
+
+	static const char	*stagename( int stage );
+
+	profiler() :
+		frameCount(0),
+		active(-1),
+		timerQueries(false)
+	{}
+protected:
+	typedef std::chrono::steady_clock clock;
+	double	Now() const;
+	void	ReadQueries( int set, bool wait );
+
+	clock::time_point epoch;
+	profframe_s history[PROFILE_HISTORY];
+	uint32_t frameCount;	// frames begun so far, the current one is frameCount-1
+	int active;		// stage between begin and end, or -1
+
+	bool timerQueries;
+	GLuint queries[PROFILE_QUERY_SETS][NUM_STAGES];
+	uint32_t queryFrame[PROFILE_QUERY_SETS];	// frame number + 1 of the set, 0 if unused
+	bool queryIssued[PROFILE_QUERY_SETS][NUM_STAGES];
+};
+
+#endif // PROFILE_H
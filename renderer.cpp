@@ -23,7 +23,19 @@
  */
 
 // includes
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 #include "main.h"
+#include "bspmap.h"
 #include "renderer.h"
 
 void error_callback(int error, const char* description);
@@ -44,25 +56,214 @@ void error_callback(int error, const char* description)
 	con_printf( "GLFW: An error (%i) occurred: %s\n", error, description );
 }
 
+// loads a shader source and puts the given #defines right after its #version line
+static tdogl::Shader ShaderWithDefines(const char* filename, GLenum shaderType, const std::string& defines) {
+    std::ifstream f(filename, std::ios::in | std::ios::binary);
+    if(!f.is_open())
+        throw std::runtime_error(std::string("Failed to open file: ") + filename);
+    std::stringstream buffer;
+    buffer << f.rdbuf();
+
+    std::string code = buffer.str();
+    size_t eol = code.find('\n');
+    code.insert(eol == std::string::npos ? code.size() : eol + 1, defines);
+    return tdogl::Shader(code, shaderType);
+}
+
+// vertex shader inputs in ATTRIB_* order
+static const char* attribNames[NUM_ATTRIBS] = {
+    "vert", "vertTexCoord", "vertLightmap", "vertNormal", "vertLayer"
+};
+
 // returns a new tdogl::Program created from the given vertex and fragment shader filenames
-static tdogl::Program* LoadShaders(const char* vertFilename, const char* fragFilename) {
+static tdogl::Program* LoadShaders(const char* vertFilename, const char* fragFilename, const std::string& defines = "") {
     std::vector<tdogl::Shader> shaders;
-    shaders.push_back(tdogl::Shader::shaderFromFile(vertFilename, GL_VERTEX_SHADER));
-    shaders.push_back(tdogl::Shader::shaderFromFile(fragFilename, GL_FRAGMENT_SHADER));
-    return new tdogl::Program(shaders);
+    shaders.push_back(ShaderWithDefines(vertFilename, GL_VERTEX_SHADER, defines));
+    shaders.push_back(ShaderWithDefines(fragFilename, GL_FRAGMENT_SHADER, defines));
+    return new tdogl::Program(shaders, std::vector<std::string>(attribNames, attribNames + NUM_ATTRIBS));
+}
+
+// connects the shared uniform blocks and sets the texture unit, once
+static void SetupProgram(tdogl::Program* shaders)
+{
+	shaders->bindUniformBlock("Camera", BLOCK_CAMERA);
+	shaders->bindUniformBlock("Model", BLOCK_MODEL);
+	shaders->bindUniformBlock("Lights", BLOCK_LIGHTS);
+
+	shaders->use();
+	shaders->setUniform(shaders->uniformHandle("materialTex"), 0); //set to 0 because the texture will be bound to GL_TEXTURE0
+	shaders->setUniform(shaders->uniformHandle("lightmapTex"), 1);
+	shaders->stopUsing();
 }
 
+static_assert(sizeof(CameraBlock) == 80, "CameraBlock must match std140");
+static_assert(sizeof(ModelBlock) == 176, "ModelBlock must match std140");
+static_assert(sizeof(LightStd140) == 64, "Light must match std140");
+static_assert(offsetof(LightBlock, allLights) == 16, "LightBlock must match std140");
+static_assert(sizeof(DrawElementsIndirectCommand) == 20, "DrawCommand must match std430");
+static_assert(sizeof(patchlod_s) == 12, "PatchLod must match std430");
+
+static size_t AlignUp(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+// connects a vertex attribute to the bound VBO, at its fixed ATTRIB_* location
+static void VertexAttrib(GLuint loc, GLint size, GLenum type,
+		GLboolean normalized, GLsizei stride, size_t offset, bool integer = false)
+{
+	glEnableVertexAttribArray(loc);
+	if (integer)
+		glVertexAttribIPointer(loc, size, type, stride, (const GLvoid*)offset);
+	else
+		glVertexAttribPointer(loc, size, type, normalized, stride, (const GLvoid*)offset);
+}
+
+// IEEE half float, rounded to nearest
+static GLushort FloatToHalf(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	uint32_t sign = (x >> 16) & 0x8000;
+	int32_t exponent = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = x & 0x7fffff;
+
+	if (((x >> 23) & 0xff) == 0xff)
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	if (exponent >= 31)
+		return sign | 0x7c00;
+	if (exponent <= 0) {
+		// denormal or zero
+		if (exponent < -10)
+			return sign;
+		mantissa |= 0x800000;
+		uint32_t shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1)
+			half++;
+		return sign | half;
+	}
+	GLushort half = sign | (exponent << 10) | (mantissa >> 13);
+	// a carry out of the mantissa correctly bumps the exponent
+	if (mantissa & 0x1000)
+		half++;
+	return half;
+}
+
+static GLbyte FloatToSnorm8(float f)
+{
+	return (GLbyte)roundf(glm::clamp(f, -1.0f, 1.0f) * 127.0f);
+}
+
+// octahedral normal encoding, unpacked again in the vertex shader
+static void OctEncode(const float *n, GLbyte *out)
+{
+	float sum = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+	if (sum == 0.0f) {
+		out[0] = out[1] = 0;
+		return;
+	}
+	float x = n[0] / sum;
+	float y = n[1] / sum;
+	if (n[2] < 0.0f) {
+		float ox = x;
+		x = (1.0f - fabsf(y)) * (ox >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabsf(ox)) * (y >= 0.0f ? 1.0f : -1.0f);
+	}
+	out[0] = FloatToSnorm8(x);
+	out[1] = FloatToSnorm8(y);
+}
+
+// vertex k of the pool, the patch vertices may be held apart from the map's
+static const drawVert_s* PoolVertex(const renderdata_s *renderData, uint_t k)
+{
+	uint_t mapcount = renderData->patchVtxData ? renderData->vtxcount - renderData->patchvtxcount : renderData->vtxcount;
+	if (k < mapcount)
+		return static_cast<const drawVert_s*>(renderData->vtxData) + k;
+	return static_cast<const drawVert_s*>(renderData->patchVtxData) + (k - mapcount);
+}
+
+// packs the map's vertices and returns the position scale and bias
+static PackedVertex* PackVertices(const renderdata_s *renderData, glm::vec3 *scale, glm::vec3 *bias)
+{
+	glm::vec3 mins(FLT_MAX), maxs(-FLT_MAX);
+
+	for (uint_t k=0;k<renderData->vtxcount;k++) {
+		const float *xyz = PoolVertex(renderData, k)->xyz;
+		glm::vec3 p(xyz[0], xyz[1], xyz[2]);
+		mins = glm::min(mins, p);
+		maxs = glm::max(maxs, p);
+	}
+	*bias = mins;
+	*scale = maxs - mins;
+	for (int i=0;i<3;i++)
+		if ((*scale)[i] <= 0.0f)
+			(*scale)[i] = 1.0f;
+
+	PackedVertex *packed = new PackedVertex[renderData->vtxcount];
+	for (uint_t k=0;k<renderData->vtxcount;k++) {
+		const drawVert_s *v = PoolVertex(renderData, k);
+		PackedVertex *p = packed + k;
+		for (int i=0;i<3;i++)
+			p->xyz[i] = (GLushort)roundf((v->xyz[i] - (*bias)[i]) / (*scale)[i] * 65535.0f);
+		p->layer[0] = renderData->layerData[2*k];
+		p->layer[1] = renderData->layerData[2*k+1];
+		p->st[0] = FloatToHalf(v->st[0]);
+		p->st[1] = FloatToHalf(v->st[1]);
+		p->lightmap[0] = FloatToHalf(v->lightmap[0]);
+		p->lightmap[1] = FloatToHalf(v->lightmap[1]);
+		OctEncode(v->normal, p->normal);
+	}
+	return packed;
+}
+
+
+// a decoded texture on its way from a decode worker to the GL thread
+struct DecodedTexture {
+	uint_t layer;
+	tdogl::Bitmap *bmp;	// NULL if decoding failed
+};
+
+// bounded so the workers can't run away from the uploads
+class TextureQueue {
+public:
+	TextureQueue(size_t capacity) : _capacity(capacity) {}
+
+	void push(const DecodedTexture& tex) {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_notFull.wait(lock, [this]() { return _items.size() < _capacity; });
+		_items.push_back(tex);
+		_notEmpty.notify_one();
+	}
+
+	DecodedTexture pop() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_notEmpty.wait(lock, [this]() { return !_items.empty(); });
+		DecodedTexture tex = _items.front();
+		_items.pop_front();
+		_notFull.notify_one();
+		return tex;
+	}
+
+private:
+	size_t _capacity;
+	std::deque<DecodedTexture> _items;
+	std::mutex _mutex;
+	std::condition_variable _notFull;
+	std::condition_variable _notEmpty;
+};
 
 // returns a new tdogl::Texture created from the given filenames
 static tdogl::Texture* LoadTextures(const char** filenames, uint_t texcount)
 {
 	uint_t maxwidth=0, maxheight=0;
 
-	// find maximum tex dimensions
+	// find maximum tex dimensions, only the image headers are read here
 	for (uint_t k=0;k<texcount;k++) {
-		tdogl::Bitmap bmp = tdogl::Bitmap::bitmapFromFile(filenames[k]);
-		maxwidth = std::max(maxwidth,bmp.width());
-		maxheight = std::max(maxheight,bmp.height());
+		uint_t width, height;
+		tdogl::Bitmap::infoFromFile(filenames[k], &width, &height);
+		maxwidth = std::max(maxwidth,width);
+		maxheight = std::max(maxheight,height);
 	}
 
 	tdogl::Texture *tex = new tdogl::Texture(maxwidth,maxheight,texcount);
@@ -71,16 +272,79 @@ static tdogl::Texture* LoadTextures(const char** filenames, uint_t texcount)
 		con_printf( "Texture Error %i (%s)\n",error, glewGetErrorString(error) );
 	}
 
+	// workers decode, convert and flip, this thread only uploads
+	tdogl::Bitmap::prepareDecoders();
+	uint_t numworkers = std::max( std::thread::hardware_concurrency(), 1u );
+	TextureQueue queue( 2*numworkers );
+	std::atomic<uint_t> next(0);
+	auto worker = [&]() {
+		uint_t k;
+		while ((k = next++) < texcount) {
+			DecodedTexture decoded = { k, tdogl::Bitmap::textureFromFile(filenames[k]) };
+			queue.push(decoded);
+		}
+	};
+	std::vector<std::thread> pool;
+	for (uint_t k=0;k<numworkers;k++)
+		pool.push_back( std::thread( worker ) );
+
 	for (uint_t k=0;k<texcount;k++) {
-		tdogl::Bitmap bmp = tdogl::Bitmap::bitmapFromFile(filenames[k]);
-		bmp.flipVertically();
-		tex->AddTexture(bmp);
+		DecodedTexture decoded = queue.pop();
+		if (decoded.bmp == NULL)
+			continue;
+		tex->AddTexture(*decoded.bmp, decoded.layer);
+		delete decoded.bmp;
 		GLenum error = glGetError();
 		if(error != GL_NO_ERROR) {
 			con_printf( "AddTexture Error %i (%s)\n",error, glewGetErrorString(error) );
 		}
 	}
+	for (size_t k=0;k<pool.size();k++)
+		pool[k].join();
+
+	return tex;
+}
+
+// returns a texture array of the textures baked into the map cache
+static tdogl::Texture* LoadCachedTextures(const renderdata_s *renderData)
+{
+	uint_t maxwidth=1, maxheight=1;
+	for (uint_t k=0;k<renderData->texcount;k++) {
+		maxwidth = std::max(maxwidth, renderData->teximages[k].width);
+		maxheight = std::max(maxheight, renderData->teximages[k].height);
+	}
+
+	// already converted and flipped, straight from the mapped file
+	tdogl::Texture *tex = new tdogl::Texture(maxwidth,maxheight,renderData->texcount);
+	for (uint_t k=0;k<renderData->texcount;k++) {
+		const textureimage_s& image = renderData->teximages[k];
+		if (image.width == 0)
+			continue;
+		tdogl::Bitmap bmp(image.width, image.height, tdogl::Bitmap::Format_RGBA,
+			renderData->texData + image.offset);
+		tex->AddTexture(bmp, k);
+	}
+	GLenum error = glGetError();
+	if(error != GL_NO_ERROR) {
+		con_printf( "Texture Error %i (%s)\n",error, glewGetErrorString(error) );
+	}
+	return tex;
+}
 
+// returns a texture array with one layer per lightmap page
+static tdogl::Texture* LoadLightmaps(const uint8_t* data, uint_t count)
+{
+	tdogl::Texture *tex = new tdogl::Texture(LIGHTMAP_SIZE, LIGHTMAP_SIZE, count);
+	for (uint_t k=0;k<count;k++) {
+		tdogl::Bitmap page(LIGHTMAP_SIZE, LIGHTMAP_SIZE, tdogl::Bitmap::Format_RGB,
+			data + k*LIGHTMAP_BLOCK_LEN);
+		tex->AddTexture(page, k);
+	}
+	GLenum error = glGetError();
+	if(error != GL_NO_ERROR) {
+		con_printf( "Lightmap Error %i (%s)\n",error, glewGetErrorString(error) );
+	}
+	con_printf( "%u lightmaps uploaded\n", count );
 	return tex;
 }
 
@@ -89,6 +353,9 @@ void renderer::update(float secondsElapsed)
 {
 	GLFWwindow	*w = mainwindow;
 	static bool	gpressed = false;
+	static bool	ppressed = false;
+	static bool	npressed = false;
+	static bool	opressed = false;
 
 	// check for close keys
 	if ( glfwGetKey(w,GLFW_KEY_ESCAPE) || glfwGetKey(w,GLFW_KEY_ENTER) )
@@ -97,21 +364,36 @@ void renderer::update(float secondsElapsed)
 
 	//move position of camera based on WASD keys, and XZ keys for up and down
 	const float moveSpeed = 500.0; //units per second
+	glm::vec3 move(0, 0, 0);
 	if(glfwGetKey(w, 'S')){
-		gCamera.offsetPosition(secondsElapsed * moveSpeed * -gCamera.forward());
+		move -= gCamera.forward();
 	} else if(glfwGetKey(w, 'W')){
-		gCamera.offsetPosition(secondsElapsed * moveSpeed * gCamera.forward());
+		move += gCamera.forward();
 	}
 	if(glfwGetKey(w, 'A')){
-		gCamera.offsetPosition(secondsElapsed * moveSpeed * -gCamera.right());
+		move -= gCamera.right();
 	} else if(glfwGetKey(w, 'D')){
-		gCamera.offsetPosition(secondsElapsed * moveSpeed * gCamera.right());
+		move += gCamera.right();
 	}
 	if(glfwGetKey(w, 'Z')){
-		gCamera.offsetPosition(secondsElapsed * moveSpeed * -gCamera.up());
+		move -= gCamera.up();
 	} else if(glfwGetKey(w, 'X')){
-		gCamera.offsetPosition(secondsElapsed * moveSpeed * gCamera.up());
+		move += gCamera.up();
 	}
+	MoveCamera(secondsElapsed * moveSpeed * move);
+	if ( glfwGetKey(w,'N') ) {
+		if ( !npressed ) {
+			noclip = !noclip;
+			con_printf( "noclip %s\n", noclip ? "on" : "off" );
+			npressed = true;
+		}
+	} else npressed = false;
+	if ( glfwGetKey(w,'O') ) {
+		if ( !opressed ) {
+			ToggleAreaPortal();
+			opressed = true;
+		}
+	} else opressed = false;
 	if ( glfwGetKey(w,'G') ) {
 		if ( !gpressed ) {
 			const glm::vec3& pos = gCamera.position();
@@ -119,6 +401,12 @@ void renderer::update(float secondsElapsed)
 			gpressed = true;
 		}
 	} else gpressed = false;
+	if ( glfwGetKey(w,'P') ) {
+		if ( !ppressed ) {
+			profile.summary();
+			ppressed = true;
+		}
+	} else ppressed = false;
 
 	//rotate camera based on mouse movement
 	const float mouseSensitivity = 0.2f;
@@ -128,6 +416,65 @@ void renderer::update(float secondsElapsed)
 	glfwSetCursorPos(mainwindow, 0, 0); //reset the mouse, so it doesn't go out of the window
 }
 
+/*
+================
+renderer::ToggleAreaPortal
+
+open or close the area portal closest to the camera, as a door would
+================
+*/
+void renderer::ToggleAreaPortal()
+{
+	const glm::vec3& pos = gCamera.position();
+	const float campos[3] = { pos.x, pos.y, pos.z };
+	int num = world ? world->nearestareaportal( campos ) : -1;
+	if (num < 0) {
+		con_printf( "no areaportals\n" );
+		return;
+	}
+	const areaportal_s *portal = world->areaportal( num );
+	world->setareaportal( num, !portal->open );
+	con_printf( "areaportal %i between areas %i and %i %s\n", num,
+			portal->area[0], portal->area[1], portal->open ? "open" : "closed" );
+}
+
+/*
+================
+renderer::MoveCamera
+
+slide the camera's box along the world brushes it runs into
+================
+*/
+void renderer::MoveCamera(glm::vec3 move)
+{
+	glm::vec3 pos = gCamera.position();
+	if (world == NULL || noclip) {
+		gCamera.setPosition(pos + move);
+		return;
+	}
+
+	const float mins[3] = { -CAMERA_HULL, -CAMERA_HULL, -CAMERA_HULL };
+	const float maxs[3] = { CAMERA_HULL, CAMERA_HULL, CAMERA_HULL };
+	for (int bump=0;bump<CAMERA_BUMPS && glm::dot(move, move) > 0;bump++) {
+		glm::vec3 end = pos + move;
+		trace_s tr;
+		world->trace(&tr, &pos[0], &end[0], mins, maxs, MASK_PLAYERSOLID);
+		// let a camera that is stuck in a wall fly out of it
+		if (tr.startsolid) {
+			pos = end;
+			break;
+		}
+		pos = glm::vec3(tr.endpos[0], tr.endpos[1], tr.endpos[2]);
+		if (tr.fraction == 1)
+			break;
+		// what is left of the move, along the plane that was hit
+		glm::vec3 normal(tr.plane.normal[0], tr.plane.normal[1], tr.plane.normal[2]);
+		move *= 1 - tr.fraction;
+		move -= normal * glm::dot(move, normal);
+	}
+	gCamera.setPosition(pos);
+}
+
 /*
 ================
 GLFW_Init
@@ -140,7 +487,19 @@ void renderer::init( const char *name )
 	GLenum error;
 	glfwSetErrorCallback(error_callback);
 
-	if (!glfwInit()) {
+	screenWidth = headless ? headlessOptions.width : (int)SCREEN_SIZE.x;
+	screenHeight = headless ? headlessOptions.height : (int)SCREEN_SIZE.y;
+
+	bool initialized = glfwInit();
+#if defined(GLFW_PLATFORM_NULL) && defined(GLFW_OSMESA_CONTEXT_API)
+	// no display on the build agents, let OSMesa provide the context
+	if (!initialized && headless) {
+		con_printf( "no display, trying OSMesa\n" );
+		glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+		initialized = glfwInit();
+	}
+#endif
+	if (!initialized) {
 		printf( "glfwInit failed.\n");
 		exit(EXIT_FAILURE);
 	}
@@ -148,6 +507,10 @@ void renderer::init( const char *name )
 	createwindow( name );
 
 	GLEW_Init();
+	profile.init();
+
+	if (headless)
+		CreateOffscreen();
 
 	glEnable(GL_DEPTH_TEST);
 	glDepthFunc(GL_LESS);
@@ -156,10 +519,15 @@ void renderer::init( const char *name )
 
 	CreateInstances();
 
+	// uniform blocks have to start at multiples of the offset alignment
+	glGenBuffers(1, &uniformBuffer);
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlign);
+	modelBlockStride = AlignUp(sizeof(ModelBlock), uniformAlign);
+
 	// setup gCamera
 	gCamera.setPosition(glm::vec3(0,0,0));
 	gCamera.lookAt(glm::vec3(1,0,0));
-	gCamera.setViewportAspectRatio(SCREEN_SIZE.x / SCREEN_SIZE.y);
+	gCamera.setViewportAspectRatio((float)screenWidth / screenHeight);
 	gCamera.setNearAndFarPlanes(1.0f, 5000.0f);
 
 	// setup lights
@@ -198,57 +566,465 @@ void renderer::createwindow( const char *name )
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-
-	mainwindow = glfwCreateWindow(SCREEN_SIZE.x, SCREEN_SIZE.y, name, NULL, NULL);
+	// headless runs only need the window for its context
+	glfwWindowHint(GLFW_VISIBLE, headless ? GL_FALSE : GL_TRUE);
+#if defined(GLFW_PLATFORM_NULL) && defined(GLFW_OSMESA_CONTEXT_API)
+	// glfwInit resets the window hints, so this can only be set after it
+	if (headless && glfwGetPlatform() == GLFW_PLATFORM_NULL)
+		glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+#endif
+
+	mainwindow = glfwCreateWindow(screenWidth, screenHeight, name, NULL, NULL);
 	if (!mainwindow) {
 		printf("glfwOpenWindow failed.\n");
 		exit(EXIT_FAILURE);
 	}
 
 	// GLFW settings
-	glfwSetInputMode(mainwindow, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-	glfwSetCursorPos(mainwindow, 0, 0);
+	if (!headless) {
+		glfwSetInputMode(mainwindow, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+		glfwSetCursorPos(mainwindow, 0, 0);
+	}
 
 	glfwMakeContextCurrent(mainwindow);
 }
 
-void renderer::setVertexData( renderdata_s *renderData )
+/*
+================
+renderer::CreateOffscreen
+
+framebuffer of the headless resolution, left bound for all drawing
+================
+*/
+void renderer::CreateOffscreen()
+{
+	glGenRenderbuffers(1, &offscreenColor);
+	glBindRenderbuffer(GL_RENDERBUFFER, offscreenColor);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, screenWidth, screenHeight);
+	glGenRenderbuffers(1, &offscreenDepth);
+	glBindRenderbuffer(GL_RENDERBUFFER, offscreenDepth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, screenWidth, screenHeight);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &offscreenFbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, offscreenFbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, offscreenColor);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, offscreenDepth);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		con_printf( "offscreen framebuffer incomplete\n" );
+		exit(EXIT_FAILURE);
+	}
+	glViewport(0, 0, screenWidth, screenHeight);
+	con_printf( "headless, rendering %ix%i offscreen\n", screenWidth, screenHeight );
+}
+
+void renderer::setVertexData( renderdata_s *renderData, bool compact, bool gpucull, bool baked )
 {
+	// baked lighting replaces the light loop with a lightmap fetch
+	baked = baked && renderData->lightmapcount > 0;
+	std::string defines;
+	if (compact)
+		defines += "#define PACKED_VERTS\n";
+	if (baked)
+		defines += "#define BAKED_LIGHTING\n";
+
 	// set all the elements of gWoodenCrate
-	gMap.shaders = LoadShaders("vertex-shader.txt", "fragment-shader.txt");
+	shaderDefines = defines;
+	bakedLighting = baked;
 	gMap.drawType = GL_TRIANGLES;
 	gMap.drawStart = 0;
-	gMap.drawCount = renderData->vtxcount;
-	gMap.texture = LoadTextures(renderData->texarray,renderData->texcount);
+	gMap.drawCount = renderData->idxcount;
+	if (renderData->teximages)
+		gMap.texture = LoadCachedTextures(renderData);
+	else
+		gMap.texture = LoadTextures(renderData->texarray,renderData->texcount);
+	if (baked)
+		gMap.lightmaps = LoadLightmaps(renderData->lightmapData, renderData->lightmapcount);
 	gMap.shininess = 80.0;
 	gMap.specularColor = glm::vec3(1.0f, 1.0f, 1.0f);
+	gMap.shaders = ShaderVariant(ShaderFlags(gMap));
 	glGenBuffers(1, &gMap.vbo);
+	glGenBuffers(1, &gMap.ibo);
 	glGenVertexArrays(1, &gMap.vao);
 
 	// bind the VAO
 	glBindVertexArray(gMap.vao);
-
-	// bind the VBO
 	glBindBuffer(GL_ARRAY_BUFFER, gMap.vbo);
 
-	// Send the buffer data
-	const uint_t flpervertex = 3+3+3;
-	glBufferData(GL_ARRAY_BUFFER, gMap.drawCount*flpervertex*sizeof(GLfloat), renderData->vtxData, GL_STATIC_DRAW);
-
-	// connect the xyz to the "vert" attribute of the vertex shader
-	glEnableVertexAttribArray(gMap.shaders->attrib("vert"));
-	glVertexAttribPointer(gMap.shaders->attrib("vert"), 3, GL_FLOAT, GL_FALSE, flpervertex*sizeof(GLfloat), NULL);
+	if (compact) {
+		PackedVertex *packed = PackVertices(renderData, &gMap.vertScale, &gMap.vertBias);
+		const GLsizei stride = sizeof(PackedVertex);
+		glBufferData(GL_ARRAY_BUFFER, renderData->vtxcount*stride, packed, GL_STATIC_DRAW);
+		delete[] packed;
+
+		VertexAttrib(ATTRIB_VERT, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, offsetof(PackedVertex, xyz));
+		VertexAttrib(ATTRIB_LAYER, 2, GL_UNSIGNED_SHORT, GL_FALSE, stride, offsetof(PackedVertex, layer), true);
+		VertexAttrib(ATTRIB_TEXCOORD, 2, GL_HALF_FLOAT, GL_FALSE, stride, offsetof(PackedVertex, st));
+		VertexAttrib(ATTRIB_LIGHTMAP, 2, GL_HALF_FLOAT, GL_FALSE, stride, offsetof(PackedVertex, lightmap));
+		VertexAttrib(ATTRIB_NORMAL, 2, GL_BYTE, GL_TRUE, stride, offsetof(PackedVertex, normal));
+		con_printf( "world vertices: %u bytes packed\n", renderData->vtxcount*stride );
+	} else {
+		// the map's vertex pool goes up unchanged, the patch vertices behind it
+		const GLsizei stride = sizeof(drawVert_s);
+		if (renderData->patchVtxData) {
+			GLsizeiptr mapsize = (renderData->vtxcount - renderData->patchvtxcount)*stride;
+			glBufferData(GL_ARRAY_BUFFER, renderData->vtxcount*stride, NULL, GL_STATIC_DRAW);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, mapsize, renderData->vtxData);
+			glBufferSubData(GL_ARRAY_BUFFER, mapsize, renderData->patchvtxcount*stride, renderData->patchVtxData);
+		} else
+			glBufferData(GL_ARRAY_BUFFER, renderData->vtxcount*stride, renderData->vtxData, GL_STATIC_DRAW);
+
+		VertexAttrib(ATTRIB_VERT, 3, GL_FLOAT, GL_FALSE, stride, offsetof(drawVert_s, xyz));
+		VertexAttrib(ATTRIB_TEXCOORD, 2, GL_FLOAT, GL_FALSE, stride, offsetof(drawVert_s, st));
+		VertexAttrib(ATTRIB_LIGHTMAP, 2, GL_FLOAT, GL_FALSE, stride, offsetof(drawVert_s, lightmap));
+		VertexAttrib(ATTRIB_NORMAL, 3, GL_FLOAT, GL_FALSE, stride, offsetof(drawVert_s, normal));
+
+		// the texture and lightmap layers come from their own buffer
+		glGenBuffers(1, &gMap.layervbo);
+		glBindBuffer(GL_ARRAY_BUFFER, gMap.layervbo);
+		glBufferData(GL_ARRAY_BUFFER, renderData->vtxcount*2*sizeof(GLushort), renderData->layerData, GL_STATIC_DRAW);
+		VertexAttrib(ATTRIB_LAYER, 2, GL_UNSIGNED_SHORT, GL_FALSE, 0, 0, true);
+		con_printf( "world vertices: %u bytes\n", renderData->vtxcount*(stride+2*sizeof(GLushort)) );
+	}
 
-	// connect the uv coords to the "vertTexCoord" attribute of the vertex shader
-	glEnableVertexAttribArray(gMap.shaders->attrib("vertTexCoord"));
-	glVertexAttribPointer(gMap.shaders->attrib("vertTexCoord"), 3, GL_FLOAT, GL_FALSE,  flpervertex*sizeof(GLfloat), (const GLvoid*)(3 * sizeof(GLfloat)));
+	surfRank.assign(renderData->surfRank, renderData->surfRank + renderData->surfcount);
+	rankFirstIndex.assign(renderData->rankFirstIndex, renderData->rankFirstIndex + renderData->surfcount + 1);
+	surfBatches.assign(renderData->batches, renderData->batches + renderData->batchcount);
+	patches.assign(renderData->patches, renderData->patches + renderData->patchcount);
+	patchLods.assign(renderData->patchLods, renderData->patchLods + renderData->patchlodcount);
+	rankPatch.assign(renderData->surfcount, -1);
+	for (size_t p=0;p<patches.size();p++)
+		rankPatch[patches[p].rank] = p;
 
-	// connect the normal to the "vertNormal" attribute of the vertex shader
-	glEnableVertexAttribArray(gMap.shaders->attrib("vertNormal"));
-	glVertexAttribPointer(gMap.shaders->attrib("vertNormal"), 3, GL_FLOAT, GL_TRUE,  flpervertex*sizeof(GLfloat), (const GLvoid*)(6 * sizeof(GLfloat)));
+	// the index buffer is part of the VAO state
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gMap.ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, renderData->idxcount*sizeof(GLuint), renderData->idxData, GL_STATIC_DRAW);
 
 	// unbind the VAO
 	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	if (gpucull && !InitGpuCulling(renderData))
+		con_printf( "gpu culling not available, culling on the cpu\n" );
+}
+
+/*
+================
+renderer::InitGpuCulling
+
+upload the bounds and a draw command of every world surface for
+cull-compute.txt. returns false if the context can't run it
+================
+*/
+bool renderer::InitGpuCulling( const renderdata_s *renderData )
+{
+	GLuint numSurfaces = renderData->surfcount;
+	if (!GLEW_VERSION_4_3 || numSurfaces == 0)
+		return false;
+
+	try {
+		std::vector<tdogl::Shader> shaders;
+		shaders.push_back(ShaderWithDefines("cull-compute.txt", GL_COMPUTE_SHADER, ""));
+		cullProgram = new tdogl::Program(shaders);
+	} catch (const std::exception& e) {
+		con_printf( "%s\n", e.what() );
+		return false;
+	}
+	cullFrustumUniform = cullProgram->uniformHandle("frustum");
+	cullNumSurfacesUniform = cullProgram->uniformHandle("numSurfaces");
+	cullCameraOriginUniform = cullProgram->uniformHandle("cameraOrigin");
+	cullLodScaleUniform = cullProgram->uniformHandle("lodScale");
+
+	// everything is in index buffer order
+	std::vector<glm::vec4> bounds(2*numSurfaces);
+	std::vector<DrawElementsIndirectCommand> draws(numSurfaces);
+	for (GLuint r=0;r<numSurfaces;r++) {
+		glm::vec3 mins(FLT_MAX, FLT_MAX, FLT_MAX);
+		glm::vec3 maxs(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (uint32_t i=rankFirstIndex[r];i<rankFirstIndex[r+1];i++) {
+			const float *xyz = PoolVertex(renderData, renderData->idxData[i])->xyz;
+			glm::vec3 v(xyz[0], xyz[1], xyz[2]);
+			mins = glm::min(mins, v);
+			maxs = glm::max(maxs, v);
+		}
+		bounds[2*r] = glm::vec4(mins, 1.0f);
+		bounds[2*r+1] = glm::vec4(maxs, 1.0f);
+
+		DrawElementsIndirectCommand& cmd = draws[r];
+		cmd.count = rankFirstIndex[r+1] - rankFirstIndex[r];
+		cmd.instanceCount = 1;
+		cmd.firstIndex = rankFirstIndex[r];
+		cmd.baseVertex = 0;
+		cmd.baseInstance = 0;
+	}
+
+	glGenBuffers(1, &surfBoundsBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, surfBoundsBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, bounds.size()*sizeof(glm::vec4), bounds.data(), GL_STATIC_DRAW);
+
+	glGenBuffers(1, &surfDrawsBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, surfDrawsBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, draws.size()*sizeof(DrawElementsIndirectCommand), draws.data(), GL_STATIC_DRAW);
+
+	// lod choices of the patches, as in SelectPatchLod
+	std::vector<GLuint> surfLods(2*numSurfaces, 0);
+	for (size_t p=0;p<patches.size();p++) {
+		surfLods[2*patches[p].rank] = patches[p].firstLod;
+		surfLods[2*patches[p].rank+1] = patches[p].numLods;
+	}
+	glGenBuffers(1, &surfLodsBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, surfLodsBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, surfLods.size()*sizeof(GLuint), surfLods.data(), GL_STATIC_DRAW);
+
+	glGenBuffers(1, &patchLodsBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, patchLodsBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(patchLods.size(), 1)*sizeof(patchlod_s),
+		patchLods.empty() ? NULL : patchLods.data(), GL_STATIC_DRAW);
+
+	glGenBuffers(1, &surfVisBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, surfVisBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, (numSurfaces+31)/32*sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+
+	// written by the compute pass, read by the draw
+	glGenBuffers(1, &gMap.indirectBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, gMap.indirectBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, draws.size()*sizeof(DrawElementsIndirectCommand), NULL, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	gMap.indirectCount = numSurfaces;
+	visLeaf = -1;
+	surfVisBits.clear();
+
+	con_printf( "gpu culling: %u surfaces\n", numSurfaces );
+	return true;
+}
+
+/*
+================
+ExtractFrustum
+
+the six clip planes of a view projection matrix, normals facing inwards
+================
+*/
+static void ExtractFrustum(const glm::mat4& m, dplane_s *planes)
+{
+	for (int k=0;k<FRUSTUM_PLANES;k++) {
+		// left, right, bottom, top, near, far
+		int row = k / 2;
+		float sign = (k & 1) ? -1.0f : 1.0f;
+		glm::vec4 p;
+		for (int c=0;c<4;c++)
+			p[c] = m[c][3] + sign * m[c][row];
+		float len = glm::length(glm::vec3(p));
+		planes[k].normal[0] = p.x / len;
+		planes[k].normal[1] = p.y / len;
+		planes[k].normal[2] = p.z / len;
+		planes[k].dist = -p.w / len;
+	}
+}
+
+/*
+================
+renderer::PatchLodScale
+
+a patch lod with error e is good enough from e * PatchLodScale() units away
+================
+*/
+float renderer::PatchLodScale() const
+{
+	float pixelsPerUnit = screenHeight * 0.5f / tanf(glm::radians(gCamera.fieldOfView()) * 0.5f);
+	return pixelsPerUnit / PATCH_LOD_PIXELS;
+}
+
+/*
+================
+SelectPatchLod
+
+the coarsest lod of a patch that is good enough from campos,
+the same choice as cull-compute.txt makes
+================
+*/
+static uint32_t SelectPatchLod(const patchsurf_s& patch, const patchlod_s *lods, const float *campos, float lodScale)
+{
+	// distance to the closest point of the bounds
+	float dist = 0;
+	for (int c=0;c<3;c++) {
+		float d = campos[c] - std::min(std::max(campos[c], patch.mins[c]), patch.maxs[c]);
+		dist += d*d;
+	}
+	dist = std::max(sqrtf(dist), 1.0f);
+
+	uint32_t lod = 0;
+	while (lod+1 < patch.numLods && lods[patch.firstLod+lod+1].error * lodScale <= dist)
+		lod++;
+	return patch.firstLod + lod;
+}
+
+void renderer::setWorld( bspmap *map )
+{
+	world = map;
+}
+
+/*
+================
+renderer::CullWorld
+
+turn the surfaces in the camera's pvs and frustum into index ranges.
+the index buffer is sorted by surface type and shader, so surfaces
+next to each other in it merge into one range, and every batch
+becomes one glMultiDrawElements
+================
+*/
+void renderer::CullWorld()
+{
+	if (world == NULL || rankFirstIndex.empty()) {
+		gMap.culled = false;
+		return;
+	}
+
+	const glm::vec3& pos = gCamera.position();
+	const float campos[3] = { pos.x, pos.y, pos.z };
+	dplane_s frustum[FRUSTUM_PLANES];
+	ExtractFrustum(gCamera.matrix(), frustum);
+	world->visiblesurfaces( campos, frustum, &visSurfaces );
+
+	visRanks.clear();
+	for (size_t k=0;k<visSurfaces.size();k++)
+		visRanks.push_back(surfRank[visSurfaces[k]]);
+	std::sort(visRanks.begin(), visRanks.end());
+
+	float lodScale = PatchLodScale();
+	gMap.rangeCounts.clear();
+	gMap.rangeOffsets.clear();
+	gMap.batchRanges.clear();
+	size_t batch = 0;
+	size_t openBatch = SIZE_MAX;
+	uint32_t rangeEnd = UINT32_MAX;
+	for (size_t k=0;k<visRanks.size();k++) {
+		uint32_t r = visRanks[k];
+		uint32_t first = rankFirstIndex[r];
+		uint32_t count = rankFirstIndex[r+1] - first;
+		if (rankPatch[r] >= 0) {
+			const patchlod_s& lod = patchLods[SelectPatchLod(patches[rankPatch[r]], patchLods.data(), campos, lodScale)];
+			first = lod.firstIndex;
+			count = lod.numIndexes;
+		}
+		if (count == 0)
+			continue;
+		while (r >= surfBatches[batch].firstRank + surfBatches[batch].numRanks)
+			batch++;
+		if (batch != openBatch) {
+			gMap.batchRanges.push_back(0);
+			openBatch = batch;
+			rangeEnd = UINT32_MAX;
+		}
+		if (first == rangeEnd)
+			gMap.rangeCounts.back() += count;
+		else {
+			gMap.rangeCounts.push_back(count);
+			gMap.rangeOffsets.push_back((const GLvoid*)(first*sizeof(GLuint)));
+			gMap.batchRanges.back()++;
+		}
+		rangeEnd = first + count;
+	}
+	gMap.culled = true;
+}
+
+/*
+================
+renderer::GpuCullWorld
+
+refresh the pvs bits when the camera changes leafs or an area portal
+connects or separates areas, then let
+cull-compute.txt write the draw commands for the frustum
+================
+*/
+void renderer::GpuCullWorld()
+{
+	const glm::vec3& pos = gCamera.position();
+	const float campos[3] = { pos.x, pos.y, pos.z };
+
+	int leaf = world ? world->pointleaf( campos ) : -1;
+	uint32_t areas = world ? world->areastate() : 0;
+	if (leaf != visLeaf || areas != visAreas || surfVisBits.empty()) {
+		surfVisBits.assign((gMap.indirectCount+31)/32, world ? 0 : ~0u);
+		if (world) {
+			world->visiblesurfaces( campos, NULL, &visSurfaces );
+			for (size_t k=0;k<visSurfaces.size();k++) {
+				uint32_t r = surfRank[visSurfaces[k]];
+				surfVisBits[r>>5] |= 1u << (r&31);
+			}
+		}
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, surfVisBuffer);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, surfVisBits.size()*sizeof(GLuint), surfVisBits.data());
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		visLeaf = leaf;
+		visAreas = areas;
+	}
+
+	dplane_s frustum[FRUSTUM_PLANES];
+	ExtractFrustum(gCamera.matrix(), frustum);
+	GLfloat planes[4*FRUSTUM_PLANES];
+	for (int k=0;k<FRUSTUM_PLANES;k++) {
+		planes[4*k+0] = frustum[k].normal[0];
+		planes[4*k+1] = frustum[k].normal[1];
+		planes[4*k+2] = frustum[k].normal[2];
+		planes[4*k+3] = frustum[k].dist;
+	}
+
+	cullProgram->use();
+	cullProgram->setUniform4v(cullFrustumUniform, planes, FRUSTUM_PLANES);
+	cullProgram->setUniform(cullNumSurfacesUniform, (GLuint)gMap.indirectCount);
+	cullProgram->setUniform(cullCameraOriginUniform, pos);
+	cullProgram->setUniform(cullLodScaleUniform, PatchLodScale());
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, surfBoundsBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, surfDrawsBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, surfVisBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, gMap.indirectBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, surfLodsBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, patchLodsBuffer);
+	glDispatchCompute((gMap.indirectCount+63)/64, 1, 1);
+	cullProgram->stopUsing();
+
+	// the draw reads the commands as indirect parameters
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+}
+
+/*
+================
+renderer::ShaderFlags
+
+the SHADER_* features the lights and the asset's material need
+================
+*/
+unsigned renderer::ShaderFlags( const ModelAsset& asset ) const
+{
+	// the baked variant has no light loop to trim
+	if (bakedLighting)
+		return 0;
+
+	unsigned flags = 0;
+	int numLights = std::min((int)gLights.size(), MAX_LIGHTS);
+	for (int i=0;i<numLights;i++)
+		if (gLights[i].position.w != 0.0f && gLights[i].coneAngle < 180.0f)
+			flags |= SHADER_SPOT_LIGHTS;
+	if (asset.shininess > 0.0f && asset.specularColor != glm::vec3(0.0f, 0.0f, 0.0f))
+		flags |= SHADER_SPECULAR;
+	return flags;
+}
+
+// returns the world shaders with the given SHADER_* flags, compiling them on first use
+tdogl::Program* renderer::ShaderVariant( unsigned flags )
+{
+	if (shaderVariants[flags] == NULL) {
+		std::string defines = shaderDefines;
+		if (flags & SHADER_SPOT_LIGHTS)
+			defines += "#define SPOT_LIGHTS\n";
+		if (flags & SHADER_SPECULAR)
+			defines += "#define SPECULAR\n";
+		shaderVariants[flags] = LoadShaders("vertex-shader.txt", "fragment-shader.txt", defines);
+		SetupProgram(shaderVariants[flags]);
+	}
+	return shaderVariants[flags];
 }
 
 // convenience function that returns a translation matrix
@@ -272,52 +1048,116 @@ void renderer::CreateInstances()
 	gInstances.push_back(dot);
 }
 
-template <typename T>
-void SetLightUniform(tdogl::Program* shaders, const char* propertyName, size_t lightIndex, const T& value) {
-    std::ostringstream ss;
-    ss << "allLights[" << lightIndex << "]." << propertyName;
-    std::string uniformName = ss.str();
+/*
+================
+renderer::UpdateUniformBuffer
+
+fill the camera, light and per instance model blocks
+and upload them with a single call
+================
+*/
+void renderer::UpdateUniformBuffer()
+{
+	size_t lightOffset = AlignUp(sizeof(CameraBlock), uniformAlign);
+	size_t modelOffset = lightOffset + AlignUp(sizeof(LightBlock), uniformAlign);
+	size_t size = modelOffset + gInstances.size()*modelBlockStride;
+	if (uniformStaging.size() < size)
+		uniformStaging.resize(size);
+	uint8_t *base = uniformStaging.data();
+
+	CameraBlock *cam = reinterpret_cast<CameraBlock*>(base);
+	cam->camera = gCamera.matrix();
+	cam->cameraPosition = glm::vec4(gCamera.position(), 1.0f);
+
+	LightBlock *lights = reinterpret_cast<LightBlock*>(base + lightOffset);
+	lights->numLights = std::min((int)gLights.size(), MAX_LIGHTS);
+	for (int i=0;i<lights->numLights;i++) {
+		LightStd140 *l = lights->allLights + i;
+		l->position = gLights[i].position;
+		l->intensities = gLights[i].intensities;
+		l->attenuation = gLights[i].attenuation;
+		l->ambientCoefficient = gLights[i].ambientCoefficient;
+		l->coneCosine = cosf(glm::radians(gLights[i].coneAngle));
+		l->coneDirection = glm::normalize(gLights[i].coneDirection);
+	}
+
+	size_t k = 0;
+	std::list<ModelInstance>::const_iterator it;
+	for (it = gInstances.begin(); it != gInstances.end(); ++it, ++k) {
+		const ModelAsset *asset = it->asset;
+		ModelBlock *m = reinterpret_cast<ModelBlock*>(base + modelOffset + k*modelBlockStride);
+		m->model = it->transform;
+		glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(it->transform)));
+		for (int c=0;c<3;c++)
+			m->normalMatrix[c] = glm::vec4(normalMatrix[c], 0.0f);
+		m->vertScale = glm::vec4(asset->vertScale, 0.0f);
+		m->vertBias = glm::vec4(asset->vertBias, 0.0f);
+		m->materialSpecularColor = glm::vec4(asset->specularColor, 1.0f);
+		m->materialShininess = asset->shininess;
+	}
+
+	// orphan the old contents so the upload doesn't wait on the last frame
+	glBindBuffer(GL_UNIFORM_BUFFER, uniformBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, size, base);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-    shaders->setUniform(uniformName.c_str(), value);
+	glBindBufferRange(GL_UNIFORM_BUFFER, BLOCK_CAMERA, uniformBuffer, 0, sizeof(CameraBlock));
+	glBindBufferRange(GL_UNIFORM_BUFFER, BLOCK_LIGHTS, uniformBuffer, lightOffset, sizeof(LightBlock));
 }
 
 //renders a single `ModelInstance`
-void renderer::RenderInstance(const ModelInstance& inst)
+void renderer::RenderInstance(const ModelInstance& inst, size_t index)
 {
 	ModelAsset* asset = inst.asset;
+	//the variant for the current lights
+	asset->shaders = ShaderVariant(ShaderFlags(*asset));
 	tdogl::Program* shaders = asset->shaders;
 
 	//bind the shaders
 	shaders->use();
 
-	//set the shader uniforms
-	shaders->setUniform("camera", gCamera.matrix());
-	shaders->setUniform("model", inst.transform);
-	shaders->setUniform("materialTex", 0); //set to 0 because the texture will be bound to GL_TEXTURE0
-	shaders->setUniform("materialShininess", asset->shininess);
-	shaders->setUniform("materialSpecularColor", asset->specularColor);
-	shaders->setUniform("cameraPosition", gCamera.position());
-	shaders->setUniform("numLights", (int)gLights.size());
-
-	for(size_t i = 0; i < gLights.size(); ++i){
-		SetLightUniform(shaders, "position", i, gLights[i].position);
-		SetLightUniform(shaders, "intensities", i, gLights[i].intensities);
-		SetLightUniform(shaders, "attenuation", i, gLights[i].attenuation);
-		SetLightUniform(shaders, "ambientCoefficient", i, gLights[i].ambientCoefficient);
-		SetLightUniform(shaders, "coneAngle", i, gLights[i].coneAngle);
-		SetLightUniform(shaders, "coneDirection", i, gLights[i].coneDirection);
-	}
+	//the instance's block in the uniform buffer
+	size_t modelOffset = AlignUp(sizeof(CameraBlock), uniformAlign) + AlignUp(sizeof(LightBlock), uniformAlign);
+	glBindBufferRange(GL_UNIFORM_BUFFER, BLOCK_MODEL, uniformBuffer,
+		modelOffset + index*modelBlockStride, sizeof(ModelBlock));
 
 	//bind the texture
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D_ARRAY, asset->texture->object());
+	if (asset->lightmaps) {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, asset->lightmaps->object());
+		glActiveTexture(GL_TEXTURE0);
+	}
 
 	//bind VAO and draw
 	glBindVertexArray(asset->vao);
-	glDrawArrays(asset->drawType, asset->drawStart, asset->drawCount);
+	if (asset->indirectBuffer) {
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, asset->indirectBuffer);
+		glMultiDrawElementsIndirect(asset->drawType, GL_UNSIGNED_INT, 0, asset->indirectCount, 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+	else if (asset->culled) {
+		GLsizei first = 0;
+		for (size_t b = 0; b < asset->batchRanges.size(); ++b) {
+			glMultiDrawElements(asset->drawType, asset->rangeCounts.data() + first, GL_UNSIGNED_INT,
+				asset->rangeOffsets.data() + first, asset->batchRanges[b]);
+			first += asset->batchRanges[b];
+		}
+	}
+	else if (asset->ibo)
+		glDrawElements(asset->drawType, asset->drawCount, GL_UNSIGNED_INT, (const GLvoid*)(asset->drawStart*sizeof(GLuint)));
+	else
+		glDrawArrays(asset->drawType, asset->drawStart, asset->drawCount);
 
 	//unbind everything
 	glBindVertexArray(0);
+	if (asset->lightmaps) {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		glActiveTexture(GL_TEXTURE0);
+	}
 	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
 	shaders->stopUsing();
 }
@@ -329,14 +1169,34 @@ void renderer::Render()
 	glClearColor(0, 0, 0, 1); // black
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+	// find the visible part of the world
+	profile.begin(STAGE_CULL);
+	if (cullProgram)
+		GpuCullWorld();
+	else
+		CullWorld();
+	profile.end(STAGE_CULL);
+
+	// upload this frame's uniforms
+	profile.begin(STAGE_UNIFORMS);
+	UpdateUniformBuffer();
+	profile.end(STAGE_UNIFORMS);
+
 	// render all the instances
+	profile.begin(STAGE_DRAW);
+	size_t index = 0;
 	std::list<ModelInstance>::const_iterator it;
 	for(it = gInstances.begin(); it != gInstances.end(); ++it){
-		RenderInstance(*it);
+		RenderInstance(*it, index++);
 	}
+	profile.end(STAGE_DRAW);
 
 	// swap the display buffers (displays what was just drawn)
-	glfwSwapBuffers(mainwindow);
+	if (!headless) {
+		profile.begin(STAGE_SWAP);
+		glfwSwapBuffers(mainwindow);
+		profile.end(STAGE_SWAP);
+	}
 }
 
 /*
@@ -349,17 +1209,31 @@ render loop
 void renderer::renderloop( void )
 {
 	double lastTime = glfwGetTime();
+	double startTime = lastTime;
 	while ( !glfwWindowShouldClose(mainwindow) ) {
 		// process pending events
 		glfwPollEvents();
 
+		profile.beginframe();
+
 		// update the scene based on the time elapsed since last update
+		profile.begin(STAGE_UPDATE);
 		double thisTime = glfwGetTime();
 		update((float)(thisTime - lastTime));
 		lastTime = thisTime;
+		profile.end(STAGE_UPDATE);
+
+		if (recordFile) {
+			const glm::vec3& pos = gCamera.position();
+			demoframe_s frame = { (float)(thisTime - startTime),
+				{ pos.x, pos.y, pos.z },
+				{ gCamera.horizontalAngle(), gCamera.verticalAngle() } };
+			recording.push_back(frame);
+		}
 
 		// draw one frame
 		Render();
+		profile.endframe();
 
 		// check for errors
 		GLenum error = glGetError();
@@ -368,6 +1242,174 @@ void renderer::renderloop( void )
 				error, glewGetErrorString(error) );
 		}
 	}
+
+	if (recordFile)
+		demo_write(recordFile, recording);
+	if (traceFile) {
+		profile.flush();
+		profile.writetrace(traceFile);
+	}
+}
+
+// records the camera of every frame renderloop draws
+void renderer::record( const char *filename )
+{
+	recordFile = filename;
+	recording.clear();
+}
+
+// writes the frame timings of the end of the run as a chrome trace
+void renderer::trace( const char *filename )
+{
+	traceFile = filename;
+}
+
+/*
+================
+renderer::DumpFrame
+
+write the offscreen framebuffer as a binary ppm
+================
+*/
+void renderer::DumpFrame( const char *filename )
+{
+	std::vector<uint8_t> pixels(screenWidth * screenHeight * 3);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, screenWidth, screenHeight, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+	std::ofstream f(filename, std::ios::out | std::ios::binary);
+	if (!f.is_open()) {
+		con_printf( "could not write %s\n", filename );
+		return;
+	}
+	f << "P6\n" << screenWidth << " " << screenHeight << "\n255\n";
+	// gl rows go bottom up
+	for (int y=screenHeight-1;y>=0;y--)
+		f.write((const char*)pixels.data() + y*screenWidth*3, screenWidth*3);
+}
+
+// prints the average, percentiles and worst of a list of times in ms
+static void PrintTimes( const char *label, std::vector<double> times )
+{
+	if (times.empty())
+		return;
+	double total = 0;
+	for (size_t k=0;k<times.size();k++)
+		total += times[k];
+	std::sort(times.begin(), times.end());
+	// nearest rank
+	size_t n = times.size();
+	size_t p50 = (n * 50 + 99) / 100 - 1;
+	size_t p95 = (n * 95 + 99) / 100 - 1;
+	size_t p99 = (n * 99 + 99) / 100 - 1;
+	con_printf( "%-13s avg %8.3f  p50 %8.3f  p95 %8.3f  p99 %8.3f  worst %8.3f\n",
+		label, total / n, times[p50], times[p95], times[p99], times[n-1] );
+}
+
+/*
+================
+renderer::runbenchmark
+
+render a recorded camera path one frame per pose, as fast as possible,
+or without a path, headlessOptions.frames frames while the camera turns
+once around. prints the frame time and the cpu and gpu stage time
+statistics
+================
+*/
+void renderer::runbenchmark( const std::vector<demoframe_s> *path )
+{
+	typedef std::chrono::steady_clock clock;
+	// a recorded path is replayed at a fixed timestep
+	std::vector<demoframe_s> resampled;
+	if (path) {
+		demo_resample(*path, DEMO_TIMESTEP, &resampled);
+		path = &resampled;
+	}
+	int frames = path ? (int)path->size() : std::max(headlessOptions.frames, 1);
+	std::vector<double> times;
+	std::vector<double> stages[NUM_STAGES];
+	std::vector<double> gpuStages[NUM_STAGES];
+	times.reserve(frames);
+
+	// don't wait for vsync
+	if (!headless)
+		glfwSwapInterval(0);
+
+	// gpu times arrive PROFILE_QUERY_SETS frames late, they are collected
+	// as they come in so they cover the same frames as the cpu times
+	uint32_t firstFrame = profile.numframes();
+	auto collectGpu = [&](uint32_t frame) {
+		const profframe_s *f = profile.find(frame);
+		if (!f)
+			return;
+		for (int s=0;s<NUM_STAGES;s++)
+			if (f->gpu[s] >= 0)
+				gpuStages[s].push_back(f->gpu[s]);
+	};
+
+	clock::time_point runStart = clock::now();
+	for (int k=0;k<frames;k++) {
+		if (!headless) {
+			glfwPollEvents();
+			if (glfwWindowShouldClose(mainwindow) || glfwGetKey(mainwindow, GLFW_KEY_ESCAPE))
+				break;
+		}
+		if (path) {
+			const demoframe_s& pose = (*path)[k];
+			gCamera.setPosition(glm::vec3(pose.origin[0], pose.origin[1], pose.origin[2]));
+			gCamera.setOrientation(pose.angles[0], pose.angles[1]);
+		} else if (k > 0)
+			gCamera.offsetOrientation(0, 360.0f / frames);
+
+		profile.beginframe();
+		if (k >= PROFILE_QUERY_SETS)
+			collectGpu(firstFrame + k - PROFILE_QUERY_SETS);
+		Render();
+		// wait for the gpu, the frame isn't done before that
+		profile.begin(STAGE_FINISH);
+		glFinish();
+		profile.end(STAGE_FINISH);
+		profile.endframe();
+
+		const profframe_s& frame = profile.last();
+		times.push_back(frame.total);
+		for (int s=0;s<NUM_STAGES;s++)
+			if (frame.cpu[s] >= 0)
+				stages[s].push_back(frame.cpu[s]);
+
+		if (headlessOptions.dumpPrefix) {
+			char filename[1024];
+			snprintf(filename, sizeof(filename), "%s%04i.ppm", headlessOptions.dumpPrefix, k);
+			DumpFrame(filename);
+		}
+
+		GLenum error = glGetError();
+		if(error != GL_NO_ERROR) {
+			con_printf( "Rendering OpenGL Error %i (%s)\n",
+				error, glewGetErrorString(error) );
+		}
+	}
+	std::chrono::duration<double> elapsed = clock::now() - runStart;
+
+	// the frames still in flight
+	profile.flush();
+	uint32_t done = (uint32_t)times.size();
+	for (uint32_t k=done > PROFILE_QUERY_SETS ? done - PROFILE_QUERY_SETS : 0;k<done;k++)
+		collectGpu(firstFrame + k);
+
+	con_printf( "============================================================\n" );
+	con_printf( "%i frames at %ix%i in %.2f s, %.1f fps\n", (int)times.size(),
+		screenWidth, screenHeight, elapsed.count(), times.size() / elapsed.count() );
+	PrintTimes( "frame ms", times );
+	for (int s=0;s<NUM_STAGES;s++)
+		PrintTimes( profiler::stagename(s), stages[s] );
+	for (int s=0;s<NUM_STAGES;s++) {
+		std::string label = std::string("gpu ") + profiler::stagename(s);
+		PrintTimes( label.c_str(), gpuStages[s] );
+	}
+	if (traceFile)
+		profile.writetrace(traceFile);
+	con_printf( "============================================================\n" );
 }
 
 /*
@@ -380,8 +1422,26 @@ Cleanup and Shutdown
 void renderer::shutdown( void )
 {
 	// Cleanup
-	delete gMap.shaders;
+	for (int k=0;k<SHADER_VARIANTS;k++)
+		delete shaderVariants[k];
 	delete gMap.texture;
+	delete gMap.lightmaps;
+	glDeleteVertexArrays(1, &gMap.vao);
+	glDeleteBuffers(1, &gMap.vbo);
+	glDeleteBuffers(1, &gMap.layervbo);
+	glDeleteBuffers(1, &gMap.ibo);
+	glDeleteBuffers(1, &uniformBuffer);
+	glDeleteFramebuffers(1, &offscreenFbo);
+	glDeleteRenderbuffers(1, &offscreenColor);
+	glDeleteRenderbuffers(1, &offscreenDepth);
+	delete cullProgram;
+	glDeleteBuffers(1, &gMap.indirectBuffer);
+	glDeleteBuffers(1, &surfBoundsBuffer);
+	glDeleteBuffers(1, &surfDrawsBuffer);
+	glDeleteBuffers(1, &surfVisBuffer);
+	glDeleteBuffers(1, &surfLodsBuffer);
+	glDeleteBuffers(1, &patchLodsBuffer);
+	profile.shutdown();
 
 	glfwDestroyWindow(mainwindow);
 	glfwTerminate();
@@ -32,6 +32,72 @@
 #include "tdogl/Program.h"
 #include "tdogl/Texture.h"
 #include "tdogl/Camera.h"
+#include "demo.h"
+#include "profile.h"
+
+#define MAX_LIGHTS	10	// as in fragment-shader.txt
+#define PATCH_LOD_PIXELS	2.0f	// how far curved surfaces may be off on screen
+#define CAMERA_HULL	12.0f	// half size of the box the camera collides with
+#define CAMERA_BUMPS	4	// planes the camera slides along per move
+
+// vertex attribute locations, fixed so all shader variants share the world VAO
+enum {
+	ATTRIB_VERT,
+	ATTRIB_TEXCOORD,
+	ATTRIB_LIGHTMAP,
+	ATTRIB_NORMAL,
+	ATTRIB_LAYER,
+	NUM_ATTRIBS
+};
+
+// shader variants of the dynamic lighting path
+enum {
+	SHADER_SPOT_LIGHTS = 1,	// cone restriction of point lights
+	SHADER_SPECULAR = 2,	// specular highlights
+	SHADER_VARIANTS = 4
+};
+
+// uniform buffer binding points, shared by all programs
+enum {
+	BLOCK_CAMERA,
+	BLOCK_MODEL,
+	BLOCK_LIGHTS
+};
+
+/*
+ std140 mirrors of the uniform blocks in the shaders
+ */
+struct CameraBlock {
+	glm::mat4 camera;
+	glm::vec4 cameraPosition;
+};
+
+struct ModelBlock {
+	glm::mat4 model;
+	glm::vec4 normalMatrix[3];	// mat3, columns padded to vec4
+	glm::vec4 vertScale;
+	glm::vec4 vertBias;
+	glm::vec4 materialSpecularColor;
+	GLfloat materialShininess;
+	GLfloat pad[3];
+};
+
+struct LightStd140 {
+	glm::vec4 position;
+	glm::vec3 intensities;
+	GLfloat attenuation;
+	GLfloat ambientCoefficient;
+	GLfloat coneCosine;
+	GLfloat pad0[2];
+	glm::vec3 coneDirection;	// normalized
+	GLfloat pad1;
+};
+
+struct LightBlock {
+	GLint numLights;
+	GLint pad[3];
+	LightStd140 allLights[MAX_LIGHTS];
+};
 
 /*
  Represents a textured geometry asset
@@ -39,35 +105,83 @@
  Contains everything necessary to draw arbitrary geometry with a single texture:
 
   - shaders
-  - a texture
+  - a texture, and optionally lightmaps
   - a VBO
+  - optionally an index buffer, drawn with glDrawElements instead
   - a VAO
-  - the parameters to glDrawArrays (drawType, drawStart, drawCount)
+  - the parameters to glDrawArrays/glDrawElements (drawType, drawStart, drawCount)
+  - or, if culled, the index ranges for glMultiDrawElements (rangeCounts, rangeOffsets),
+    one call per batch of batchRanges ranges
+  - or, if culled on the gpu, a buffer of indirectCount DrawElementsIndirectCommands
  */
 struct ModelAsset {
 	tdogl::Program* shaders;
 	tdogl::Texture* texture;
+	tdogl::Texture* lightmaps;	// NULL unless the shaders use baked lighting
 	GLuint vbo;
+	GLuint layervbo;
+	GLuint ibo;
 	GLuint vao;
 	GLenum drawType;
 	GLint drawStart;
 	GLint drawCount;
 	GLfloat shininess;
 	glm::vec3 specularColor;
+	glm::vec3 vertScale;	// dequantizes packed positions in the vertex shader
+	glm::vec3 vertBias;
+	bool culled;
+	std::vector<GLsizei> rangeCounts;
+	std::vector<const GLvoid*> rangeOffsets;
+	std::vector<GLsizei> batchRanges;
+	GLuint indirectBuffer;
+	GLsizei indirectCount;
 
 	ModelAsset() :
 		shaders(NULL),
 		texture(NULL),
+		lightmaps(NULL),
 		vbo(0),
+		layervbo(0),
+		ibo(0),
 		vao(0),
 		drawType(GL_TRIANGLES),
 		drawStart(0),
 		drawCount(0),
 		shininess(0.0f),
-		specularColor(1.0f, 1.0f, 1.0f)
+		specularColor(1.0f, 1.0f, 1.0f),
+		vertScale(1.0f, 1.0f, 1.0f),
+		vertBias(0.0f, 0.0f, 0.0f),
+		culled(false),
+		indirectBuffer(0),
+		indirectCount(0)
 	{}
 };
 
+/*
+ Compact world vertex, 20 bytes instead of the 44 of a drawVert_s
+
+ Positions are quantized to 16 bits across the map bounds, see ModelAsset::vertScale.
+ */
+struct PackedVertex {
+	GLushort xyz[3];	// unorm16
+	GLbyte normal[2];	// octahedral, snorm8
+	GLushort layer[2];	// texture array layer, lightmap layer
+	GLushort st[2];		// half float
+	GLushort lightmap[2];	// half float
+};
+
+/*
+ Layout of glMultiDrawElementsIndirect commands, and the DrawCommand
+ struct in cull-compute.txt
+ */
+struct DrawElementsIndirectCommand {
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+};
+
 /*
  Represents an instance of an `ModelAsset`
 
@@ -95,6 +209,26 @@ struct Light {
 	glm::vec3 coneDirection;
 };
 
+/*
+ Settings of a headless run: frames are rendered into an offscreen
+ framebuffer of the given size, timed, and optionally written out
+ */
+struct HeadlessOptions {
+	int width;
+	int height;
+	int frames;
+	const char* dumpPrefix;	// writes <dumpPrefix>NNNN.ppm per frame, or NULL
+
+	HeadlessOptions() :
+		width(1280),
+		height(720),
+		frames(500),
+		dumpPrefix(NULL)
+	{}
+};
+
+class bspmap;
+
 class renderer
 {
 public:
@@ -102,12 +236,42 @@ public:
 	void	createwindow( const char *name );
 	void	drawFrame( void );
 	void	renderloop( void );
+	void	runbenchmark( const std::vector<demoframe_s> *path );
+	void	record( const char *filename );
+	void	trace( const char *filename );
 	void	shutdown( void );
 	void	update(float secondsElapsed);
-	void	setVertexData( renderdata_s *renderData );
-	// constructor
-	renderer( const char *name=NULL )
+	void	setVertexData( renderdata_s *renderData, bool compact=false, bool gpucull=true, bool baked=true );
+	void	setWorld( bspmap *map );
+	// constructor, options is NULL for a window
+	renderer( const char *name=NULL, const HeadlessOptions *options=NULL ) :
+		headless(options != NULL),
+		offscreenFbo(0),
+		offscreenColor(0),
+		offscreenDepth(0),
+		recordFile(NULL),
+		traceFile(NULL),
+		bakedLighting(false),
+		uniformBuffer(0),
+		world(NULL),
+		noclip(false),
+		cullProgram(NULL),
+		cullFrustumUniform(),
+		cullNumSurfacesUniform(),
+		cullCameraOriginUniform(),
+		cullLodScaleUniform(),
+		surfBoundsBuffer(0),
+		surfDrawsBuffer(0),
+		surfVisBuffer(0),
+		surfLodsBuffer(0),
+		patchLodsBuffer(0),
+		visLeaf(-1),
+		visAreas(0)
 	{
+		for (int k=0;k<SHADER_VARIANTS;k++)
+			shaderVariants[k] = NULL;
+		if (options)
+			headlessOptions = *options;
 		if (name) init( name );
 		else init( "OpenGL window" );
 	}
@@ -117,16 +281,82 @@ public:
 	}
 protected:
 	void	CreateInstances();
-	void	RenderInstance(const ModelInstance& inst);
+	tdogl::Program*	ShaderVariant( unsigned flags );
+	unsigned	ShaderFlags( const ModelAsset& asset ) const;
+	void	RenderInstance(const ModelInstance& inst, size_t index);
+	void	UpdateUniformBuffer();
 	void	Render();
+	void	CullWorld();
+	void	MoveCamera(glm::vec3 move);
+	void	ToggleAreaPortal();
+	void	CreateOffscreen();
+	void	DumpFrame( const char *filename );
+	bool	InitGpuCulling( const renderdata_s *renderData );
+	void	GpuCullWorld();
+	float	PatchLodScale() const;
 	// vars
 	GLFWwindow* mainwindow;
+	int screenWidth;
+	int screenHeight;
+
+	// headless runs draw into offscreenFbo instead of the window
+	bool headless;
+	HeadlessOptions headlessOptions;
+	GLuint offscreenFbo;
+	GLuint offscreenColor;
+	GLuint offscreenDepth;
+
+	// camera path of the interactive session, written to recordFile on exit
+	const char *recordFile;
+	std::vector<demoframe_s> recording;
+
+	// frame timing, written to traceFile on exit if set
+	profiler profile;
+	const char *traceFile;
 
 	tdogl::Camera gCamera;
 	//std::vector<tdogl::Shader> shaders;
 	ModelAsset gMap;
 	std::list<ModelInstance> gInstances;
 	std::vector<Light> gLights;
+
+	// world shader variants by SHADER_* flags, compiled when first used
+	std::string shaderDefines;
+	bool bakedLighting;
+	tdogl::Program *shaderVariants[SHADER_VARIANTS];
+
+	// one buffer holds the camera and light blocks and a model block per instance
+	GLuint uniformBuffer;
+	GLint uniformAlign;
+	size_t modelBlockStride;
+	std::vector<uint8_t> uniformStaging;
+
+	// pvs culling of the world
+	bspmap *world;
+	bool noclip;	// toggled with N, the camera flies through the brushes
+	std::vector<uint32_t> surfRank;
+	std::vector<uint32_t> rankFirstIndex;
+	std::vector<surfbatch_s> surfBatches;
+	std::vector<uint32_t> visSurfaces;
+	std::vector<uint32_t> visRanks;
+	std::vector<patchsurf_s> patches;
+	std::vector<patchlod_s> patchLods;
+	std::vector<int32_t> rankPatch;	// patch of each surface rank or -1
+
+	// gpu culling, needs GL 4.3 compute shaders and multi draw indirect
+	tdogl::Program *cullProgram;
+	tdogl::Program::Uniform cullFrustumUniform;
+	tdogl::Program::Uniform cullNumSurfacesUniform;
+	tdogl::Program::Uniform cullCameraOriginUniform;
+	tdogl::Program::Uniform cullLodScaleUniform;
+	GLuint surfBoundsBuffer;	// mins, maxs per surface rank
+	GLuint surfDrawsBuffer;		// a draw command per surface rank
+	GLuint surfVisBuffer;		// pvs bits per surface rank
+	GLuint surfLodsBuffer;		// first lod and lod count per surface rank
+	GLuint patchLodsBuffer;		// patchlod_s
+	int visLeaf;			// leaf surfVisBuffer was built for
+	uint32_t visAreas;		// bspmap::areastate it was built for
+	std::vector<GLuint> surfVisBits;
 };
 
 #endif //RENDERER_H
@@ -191,21 +191,79 @@ Bitmap::~Bitmap() {
 }
 
 #include <cstdio>
+#include "../files.h"
+
+static int StreamRead(void *user, char *data, int size) {
+    return (int)static_cast<filestream*>(user)->read(data, size);
+}
+
+static void StreamSkip(void *user, int n) {
+    static_cast<filestream*>(user)->seek(n, true);
+}
+
+static int StreamEof(void *user) {
+    return static_cast<filestream*>(user)->eof();
+}
+
+static const stbi_io_callbacks StreamCallbacks = { StreamRead, StreamSkip, StreamEof };
+
+// decodes straight from the mapping if there is one, otherwise streams the file
+static unsigned char* LoadFromStream(filestream& f, int* width, int* height, int* channels) {
+    if(f.mapped())
+        return stbi_load_from_memory(static_cast<const stbi_uc*>(f.view(0, f.length())),
+                                     (int)f.length(), width, height, channels, 0);
+    return stbi_load_from_callbacks(&StreamCallbacks, &f, width, height, channels, 0);
+}
+
+static int InfoFromStream(filestream& f, int* width, int* height, int* channels) {
+    if(f.mapped())
+        return stbi_info_from_memory(static_cast<const stbi_uc*>(f.view(0, f.length())),
+                                     (int)f.length(), width, height, channels);
+    return stbi_info_from_callbacks(&StreamCallbacks, &f, width, height, channels);
+}
+
+void Bitmap::infoFromFile(std::string filePath, unsigned* width, unsigned* height) {
+	int w, h, channels;
+	std::string fullpath;
+	std::string fExts[] = { "",".png",".jpg",".tga" };
+	int found = 0;
+
+	for ( int k=0;k<4 && !found;k++ ) {
+		fullpath = filePath + fExts[k];
+		if (!fs_findfile(fullpath.c_str()))
+			continue;
+		filestream f(fullpath.c_str(), FS_READ);
+		found = InfoFromStream(f, &w, &h, &channels);
+	}
+	if(!found)
+		found = stbi_info("white.png", &w, &h, &channels);
+	if(!found) throw std::runtime_error(stbi_failure_reason());
+
+	*width = w;
+	*height = h;
+}
+
+void Bitmap::prepareDecoders() {
+    // the fixed huffman code lengths of deflate, used by most pngs
+    if(!stbi__zdefault_distance[31])
+        stbi__init_zdefaults();
+}
+
 Bitmap Bitmap::bitmapFromFile(std::string filePath) {    
 	int width, height, channels;
 	std::string fullpath;
 	std::string fExts[] = { "",".png",".jpg",".tga" };
-	unsigned char* pixels;
-
-	for ( int k=0;k<4;k++ ) {
-		fullpath = "main/" + filePath + fExts[k];
-		pixels = stbi_load(fullpath.c_str(), &width, &height, &channels, 0);
-		if(!pixels)
-			stbi_image_free(pixels);
-		else break;
+	unsigned char* pixels = NULL;
+
+	// only hash lookups here, just the file that exists gets decoded
+	for ( int k=0;k<4 && !pixels;k++ ) {
+		fullpath = filePath + fExts[k];
+		if (!fs_findfile(fullpath.c_str()))
+			continue;
+		filestream f(fullpath.c_str(), FS_READ);
+		pixels = LoadFromStream(f, &width, &height, &channels);
 	}
 	if(!pixels) {
-		stbi_image_free(pixels);
 		printf( "could not load %s, loading white.png\n", filePath.c_str() );
 		pixels = stbi_load("white.png", &width, &height, &channels, 0);
 	}
@@ -216,6 +274,20 @@ Bitmap Bitmap::bitmapFromFile(std::string filePath) {
 	return bmp;
 }
 
+Bitmap* Bitmap::textureFromFile(std::string filePath) {
+    Bitmap* bmp = NULL;
+    try {
+        bmp = new Bitmap(bitmapFromFile(filePath));
+        bmp->convertFormat(Format_RGBA);
+        bmp->flipVertically();
+    } catch (const std::exception& e) {
+        printf( "could not decode %s: %s\n", filePath.c_str(), e.what() );
+        delete bmp;
+        bmp = NULL;
+    }
+    return bmp;
+}
+
 Bitmap::Bitmap(const Bitmap& other) :
     _pixels(NULL)
 {
@@ -269,7 +341,23 @@ void Bitmap::flipVertically() {
         memcpy(oppositeRow, rowBuffer, rowSize);
     }
     
-    delete rowBuffer;
+    delete[] rowBuffer;
+}
+
+void Bitmap::convertFormat(Format format) {
+    if(format == _format)
+        return;
+
+    FormatConverterFunc converter = ConverterFuncForFormats(_format, format);
+    unsigned pixelCount = _width*_height;
+    unsigned char* newPixels = (unsigned char*) malloc(format*pixelCount);
+
+    for(unsigned k = 0; k < pixelCount; ++k)
+        converter(_pixels + k*_format, newPixels + k*format);
+
+    free(_pixels);
+    _pixels = newPixels;
+    _format = format;
 }
 
 void Bitmap::rotate90CounterClockwise() {
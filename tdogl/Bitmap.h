@@ -58,6 +58,24 @@ namespace tdogl {
          Tries to load the given file into a tdogl::Bitmap.
          */
         static Bitmap bitmapFromFile(std::string filePath);
+
+        /**
+         Loads the file the way textures are uploaded: RGBA, bottom row
+         first. Returns NULL, after printing why, if it can't be decoded.
+         */
+        static Bitmap* textureFromFile(std::string filePath);
+
+        /**
+         Reads only the image header of the file bitmapFromFile would load,
+         without decoding any pixels.
+         */
+        static void infoFromFile(std::string filePath, unsigned* width, unsigned* height);
+
+        /**
+         Builds the tables stb_image otherwise builds on first use. Call it
+         once before decoding on several threads at the same time.
+         */
+        static void prepareDecoders();
                 
         /** width in pixels */
         unsigned width() const;
@@ -97,6 +115,11 @@ namespace tdogl {
          */
         void flipVertically();
         
+        /**
+         Converts the pixels to the given format, e.g. to upload everything as RGBA.
+         */
+        void convertFormat(Format format);
+
         /**
          Rotates the image 90 degrees counter clockwise.
          */
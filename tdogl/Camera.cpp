@@ -85,6 +85,20 @@ void Camera::offsetOrientation(float upAngle, float rightAngle) {
     normalizeAngles();
 }
 
+float Camera::horizontalAngle() const {
+    return _horizontalAngle;
+}
+
+float Camera::verticalAngle() const {
+    return _verticalAngle;
+}
+
+void Camera::setOrientation(float horizontalAngle, float verticalAngle) {
+    _horizontalAngle = horizontalAngle;
+    _verticalAngle = verticalAngle;
+    normalizeAngles();
+}
+
 void Camera::lookAt(glm::vec3 position) {
     assert(position != _position);
     glm::vec3 direction = glm::normalize(position - _position);
@@ -100,6 +100,13 @@ namespace tdogl {
          */
         void offsetOrientation(float upAngle, float rightAngle);
 
+        /**
+         The angles (in degrees) that offsetOrientation changes, e.g. to record and replay a camera path.
+         */
+        float horizontalAngle() const;
+        float verticalAngle() const;
+        void setOrientation(float horizontalAngle, float verticalAngle);
+
         /**
          Orients the camera so that is it directly facing `position`
 
@@ -22,7 +22,10 @@
 
 using namespace tdogl;
 
-Program::Program(const std::vector<Shader>& shaders) :
+// the program bound by use(), so isInUse() needn't ask GL
+GLuint Program::_current = 0;
+
+Program::Program(const std::vector<Shader>& shaders, const std::vector<std::string>& attribLocations) :
     _object(0)
 {
     if(shaders.size() <= 0)
@@ -36,6 +39,10 @@ Program::Program(const std::vector<Shader>& shaders) :
     //attach all the shaders
     for(unsigned i = 0; i < shaders.size(); ++i)
         glAttachShader(_object, shaders[i].object());
+
+    //fixed attribute locations have to be known before linking
+    for(unsigned i = 0; i < attribLocations.size(); ++i)
+        glBindAttribLocation(_object, i, attribLocations[i].c_str());
     
     //link the shaders together
     glLinkProgram(_object);
@@ -60,6 +67,45 @@ Program::Program(const std::vector<Shader>& shaders) :
         glDeleteProgram(_object); _object = 0;
         throw std::runtime_error(msg);
     }
+
+    _cacheLocations();
+}
+
+void Program::_cacheLocations() {
+    GLint count = 0, maxLength = 0;
+    GLint size;
+    GLenum type;
+
+    glGetProgramiv(_object, GL_ACTIVE_ATTRIBUTES, &count);
+    glGetProgramiv(_object, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+    std::vector<GLchar> name(maxLength + 1);
+    for(GLint i = 0; i < count; ++i){
+        glGetActiveAttrib(_object, i, (GLsizei)name.size(), NULL, &size, &type, name.data());
+        _attribs[name.data()] = glGetAttribLocation(_object, name.data());
+    }
+
+    glGetProgramiv(_object, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(_object, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    name.resize(maxLength + 1);
+    for(GLint i = 0; i < count; ++i){
+        glGetActiveUniform(_object, i, (GLsizei)name.size(), NULL, &size, &type, name.data());
+        GLint location = glGetUniformLocation(_object, name.data());
+        if(location == -1)
+            continue; // uniform block members
+        std::string uniformName(name.data());
+        _uniforms[uniformName] = location;
+
+        // arrays of basic types are reported as "name[0]", the other elements follow it
+        size_t len = uniformName.size();
+        if(len > 3 && uniformName.compare(len - 3, 3, "[0]") == 0){
+            std::string base = uniformName.substr(0, len - 3);
+            _uniforms[base] = location;
+            for(GLint k = 1; k < size; ++k){
+                std::string element = base + "[" + std::to_string(k) + "]";
+                _uniforms[element] = glGetUniformLocation(_object, element.c_str());
+            }
+        }
+    }
 }
 
 Program::~Program() {
@@ -73,39 +119,95 @@ GLuint Program::object() const {
 
 void Program::use() const {
     glUseProgram(_object);
+    _current = _object;
 }
 
 bool Program::isInUse() const {
-    GLint currentProgram = 0;
-    glGetIntegerv(GL_CURRENT_PROGRAM, &currentProgram);
-    return (currentProgram == (GLint)_object);
+    return (_current == _object);
 }
 
 void Program::stopUsing() const {
     assert(isInUse());
     glUseProgram(0);
+    _current = 0;
 }
 
 GLint Program::attrib(const GLchar* attribName) const {
     if(!attribName)
         throw std::runtime_error("attribName was NULL");
     
-    GLint attrib = glGetAttribLocation(_object, attribName);
-    if(attrib == -1)
+    std::map<std::string, GLint>::const_iterator it = _attribs.find(attribName);
+    if(it == _attribs.end())
         throw std::runtime_error(std::string("Program attribute not found: ") + attribName);
     
-    return attrib;
+    return it->second;
 }
 
 GLint Program::uniform(const GLchar* uniformName) const {
     if(!uniformName)
         throw std::runtime_error("uniformName was NULL");
     
-    GLint uniform = glGetUniformLocation(_object, uniformName);
-    if(uniform == -1)
+    std::map<std::string, GLint>::const_iterator it = _uniforms.find(uniformName);
+    if(it == _uniforms.end())
         throw std::runtime_error(std::string("Program uniform not found: ") + uniformName);
     
-    return uniform;
+    return it->second;
+}
+
+Program::Uniform Program::uniformHandle(const GLchar* uniformName) const {
+    if(!uniformName)
+        throw std::runtime_error("uniformName was NULL");
+
+    std::map<std::string, GLint>::const_iterator it = _uniforms.find(uniformName);
+    return Uniform(it == _uniforms.end() ? -1 : it->second);
+}
+
+bool Program::bindUniformBlock(const GLchar* blockName, GLuint bindingPoint) {
+    GLuint index = glGetUniformBlockIndex(_object, blockName);
+    if(index == GL_INVALID_INDEX)
+        return false;
+    glUniformBlockBinding(_object, index, bindingPoint);
+    return true;
+}
+
+void Program::setUniform(Uniform u, GLint v0) {
+    assert(isInUse());
+    glUniform1i(u.location, v0);
+}
+
+void Program::setUniform(Uniform u, GLuint v0) {
+    assert(isInUse());
+    glUniform1ui(u.location, v0);
+}
+
+void Program::setUniform(Uniform u, GLfloat v0) {
+    assert(isInUse());
+    glUniform1f(u.location, v0);
+}
+
+void Program::setUniform(Uniform u, const glm::vec3& v) {
+    assert(isInUse());
+    glUniform3fv(u.location, 1, glm::value_ptr(v));
+}
+
+void Program::setUniform(Uniform u, const glm::vec4& v) {
+    assert(isInUse());
+    glUniform4fv(u.location, 1, glm::value_ptr(v));
+}
+
+void Program::setUniform4v(Uniform u, const GLfloat* v, GLsizei count) {
+    assert(isInUse());
+    glUniform4fv(u.location, count, v);
+}
+
+void Program::setUniform(Uniform u, const glm::mat3& m, GLboolean transpose) {
+    assert(isInUse());
+    glUniformMatrix3fv(u.location, 1, transpose, glm::value_ptr(m));
+}
+
+void Program::setUniform(Uniform u, const glm::mat4& m, GLboolean transpose) {
+    assert(isInUse());
+    glUniformMatrix4fv(u.location, 1, transpose, glm::value_ptr(m));
 }
 
 #define ATTRIB_N_UNIFORM_SETTERS(OGL_TYPE, TYPE_PREFIX, TYPE_SUFFIX) \
@@ -19,6 +19,8 @@
 #pragma once
 
 #include "Shader.h"
+#include <map>
+#include <string>
 #include <vector>
 #include <glm/glm.hpp>
 
@@ -33,12 +35,15 @@ namespace tdogl {
          Creates a program by linking a list of tdogl::Shader objects
          
          @param shaders  The shaders to link together to make the program
+         @param attribLocations  Optional names bound to attribute locations 0, 1, ...
+                                 before linking, so several programs can share a VAO
          
          @throws std::exception if an error occurs.
          
          @see tdogl::Shader
          */
-        Program(const std::vector<Shader>& shaders);
+        Program(const std::vector<Shader>& shaders,
+                const std::vector<std::string>& attribLocations = std::vector<std::string>());
         ~Program();
         
         
@@ -54,16 +59,49 @@ namespace tdogl {
         void stopUsing() const;
         
         /**
-         @result The attribute index for the given name, as returned from glGetAttribLocation.
+         @result The attribute index for the given name, as resolved at link time.
          */
         GLint attrib(const GLchar* attribName) const;
         
         
         /**
-         @result The uniform index for the given name, as returned from glGetUniformLocation.
+         @result The uniform index for the given name, as resolved at link time.
          */
         GLint uniform(const GLchar* uniformName) const;
 
+        /**
+         A uniform location resolved once, for the per-frame setters below.
+         */
+        struct Uniform {
+            GLint location;
+            Uniform(GLint loc = -1) : location(loc) {}
+        };
+
+        /**
+         @result A handle for the given uniform. Unlike `uniform`, this doesn't throw if the
+         uniform is inactive, the setters then silently do nothing (location -1).
+         */
+        Uniform uniformHandle(const GLchar* uniformName) const;
+
+        /**
+         Connects the named uniform block to a uniform buffer binding point.
+
+         @result false if the program has no active block of that name.
+         */
+        bool bindUniformBlock(const GLchar* blockName, GLuint bindingPoint);
+
+        /**
+         Setters for pre-resolved uniforms, these do no lookups, no GL queries and no allocations.
+         */
+        void setUniform(Uniform u, GLint v0);
+        void setUniform(Uniform u, GLuint v0);
+        void setUniform(Uniform u, GLfloat v0);
+        void setUniform(Uniform u, const glm::vec3& v);
+        void setUniform(Uniform u, const glm::vec4& v);
+        void setUniform4v(Uniform u, const GLfloat* v, GLsizei count=1);
+        void setUniform(Uniform u, const glm::mat3& m, GLboolean transpose=GL_FALSE);
+        void setUniform(Uniform u, const glm::mat4& m, GLboolean transpose=GL_FALSE);
+
         /**
          Setters for attribute and uniform variables.
 
@@ -107,6 +145,11 @@ namespace tdogl {
         
     private:
         GLuint _object;
+        std::map<std::string, GLint> _attribs;
+        std::map<std::string, GLint> _uniforms;
+        static GLuint _current;
+
+        void _cacheLocations();
         
         //copying disabled
         Program(const Program&);
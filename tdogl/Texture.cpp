@@ -34,10 +34,15 @@ static GLenum TextureFormatForBitmapFormat(Bitmap::Format format, bool srgb)
 
 void Texture::AddTexture(const Bitmap& bitmap)
 {
-	if (_texcount == _maxtex)
+	AddTexture(bitmap, _texcount);
+}
+
+void Texture::AddTexture(const Bitmap& bitmap, unsigned int layer)
+{
+	if (_texcount == _maxtex || layer >= _maxtex)
 		throw std::runtime_error("more textures than declared max");
 
-	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, _texcount,
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer,
 		bitmap.width(), bitmap.height(), 1,
 		TextureFormatForBitmapFormat(bitmap.format(), false),
 		GL_UNSIGNED_BYTE, bitmap.pixelBuffer());
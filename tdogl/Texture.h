@@ -40,6 +40,13 @@ namespace tdogl {
          @param wrapMode GL_REPEAT, GL_MIRRORED_REPEAT, GL_CLAMP_TO_EDGE, or GL_CLAMP_TO_BORDER
          */
         void AddTexture(const Bitmap& bitmap);
+
+        /**
+         Uploads the bitmap into the given layer of the texture array.
+
+         Unlike AddTexture, the layers can be filled in any order.
+         */
+        void AddTexture(const Bitmap& bitmap, unsigned int layer);
         
         Texture( unsigned int maxwidth, unsigned int maxheight, unsigned int texcount,
                 GLint minMagFiler = GL_LINEAR,